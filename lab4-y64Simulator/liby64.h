@@ -0,0 +1,105 @@
+#ifndef _LIB_Y64_
+#define _LIB_Y64_
+
+/*
+ * libY64: the Y64 simulator as a library (build liby64.a, link -lpthread)
+ *
+ * Every image is a y64_t of its own and the library has no mutable globals,
+ * so any number of them can run at once, one thread per image.
+ *
+ *     y64_t *y = y64_create(1 << 13);
+ *     y64_load(y, buf, len);
+ *     st = y64_run(y, 10000, &steps);
+ *     rax = y64_get_reg(y, Y64_RAX);
+ *     y64_destroy(y);
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct y64sim y64_t;
+
+/* status of the last executed instruction (same order as stat_t) */
+enum { Y64_AOK, Y64_HLT, Y64_ADR, Y64_INS };
+
+/* execution engines (same order as engine_t) */
+enum { Y64_INTERP, Y64_THREADED, Y64_JIT };
+
+/* register ids (same order as regid_t) */
+enum { Y64_RAX, Y64_RCX, Y64_RDX, Y64_RBX, Y64_RSP, Y64_RBP, Y64_RSI, Y64_RDI,
+       Y64_R8, Y64_R9, Y64_R10, Y64_R11, Y64_R12, Y64_R13, Y64_R14, Y64_NREGS };
+
+/* kinds of data access passed to a y64_mem_cb */
+enum { Y64_LOAD = 'L', Y64_STORE = 'S' };
+
+/*
+ * y64_mem_cb: called before the instruction at 'pc' reads or writes the
+ *     8 bytes at 'addr' (accesses that fault are not reported)
+ */
+typedef void (*y64_mem_cb)(void *arg, int64_t pc, int kind, int64_t addr, int size);
+
+/* y64_halt_cb: called when a run or step stops with a status other than AOK */
+typedef void (*y64_halt_cb)(void *arg, int status, int64_t pc);
+
+/* an image of 'memsize' bytes of zeroed memory, NULL if it can't be made */
+y64_t *y64_create(int64_t memsize);
+void y64_destroy(y64_t *y);
+
+/*
+ * y64_load: reset the image (registers, PC and cc as after y64_create) and
+ *     copy 'len' bytes of code and data from 'buf' to address 0
+ * return
+ *     0: success
+ *     -1: the image doesn't fit in memory
+ */
+int y64_load(y64_t *y, const void *buf, size_t len);
+
+/* y64_run: execute up to 'max_steps' instructions, the number executed goes
+   to 'steps' (may be NULL); returns the status of the last one */
+int y64_run(y64_t *y, int max_steps, int *steps);
+/* y64_step: execute one instruction, returns its status */
+int y64_step(y64_t *y);
+
+int64_t y64_get_pc(y64_t *y);
+void y64_set_pc(y64_t *y, int64_t pc);
+/* registers are Y64_RAX..Y64_R14, others read as 0 and can't be set */
+int64_t y64_get_reg(y64_t *y, int reg);
+int y64_set_reg(y64_t *y, int reg, int64_t val);
+/* condition codes, ZF<<2 | SF<<1 | OF */
+int y64_get_cc(y64_t *y);
+
+/* copy memory out of or into the image, -1 if any byte is outside it */
+int64_t y64_memsize(y64_t *y);
+int y64_read(y64_t *y, int64_t addr, void *buf, size_t len);
+int y64_write(y64_t *y, int64_t addr, const void *buf, size_t len);
+
+/* Y64_INTERP (the default), Y64_THREADED or Y64_JIT; a memory callback
+   runs everything on Y64_INTERP */
+int y64_set_engine(y64_t *y, int engine);
+/* where fault messages go, NULL (the default) drops them */
+void y64_set_output(y64_t *y, FILE *out);
+/* install (or with NULL remove) the callbacks */
+void y64_on_mem(y64_t *y, y64_mem_cb cb, void *arg);
+void y64_on_halt(y64_t *y, y64_halt_cb cb, void *arg);
+
+/*
+ * y64_snapshot: take the current state as the one y64_reset() goes back to
+ *     (from then on the first write to each 32-byte block saves it)
+ * y64_reset: go back to it, copying only the blocks written since; without
+ *     a snapshot since y64_create or y64_load, only the registers, PC and
+ *     cc go back (to zero, zero and Z=1)
+ */
+void y64_snapshot(y64_t *y);
+void y64_reset(y64_t *y);
+
+/*
+ * y64_coverage: count edges between executed PCs in 'map' of 'size' bytes
+ *     (a power of two) from now on, hashed AFL style and saturating at 255;
+ *     NULL stops it. Runs everything on Y64_INTERP.
+ */
+int y64_coverage(y64_t *y, unsigned char *map, size_t size);
+
+const char *y64_status_name(int status);
+
+#endif
@@ -0,0 +1,537 @@
+/* Coverage-guided fuzzer for the Y64 simulator (built on liby64.a) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "liby64.h"
+
+#define err_print(_s, _a...) \
+    fprintf(stdout, _s "\n", _a);
+
+#define COV_MAX (1<<16)     /* largest edge map */
+#define MAX_SEEDS 4096
+#define HAVOC_MAX 8         /* mutations stacked on one input */
+#define HANG_SECS 5         /* no execution finished for this long: hang */
+#define MAX_PATH 1024
+
+typedef struct input {
+    unsigned char *buf;
+    size_t len;
+} input_t;
+
+typedef struct fuzz {
+    y64_t *y;               /* runs every input with coverage on */
+    y64_t *ref[2];          /* threaded and JIT images to cross-check (-d) */
+    unsigned char *mem[2];  /* their memory, read back to compare */
+    unsigned char cov[COV_MAX];
+    unsigned char virgin[COV_MAX];  /* hit-count buckets seen per edge */
+    long cov_size;          /* of the map in use, a power of two */
+    input_t *corpus;
+    int ncorpus, cap;
+    unsigned long rng;
+    long execs;
+    long edges;
+    long stats[Y64_INS + 1];    /* by status, Y64_AOK: out of steps */
+    long diffs;
+    int max_steps;
+    size_t max_len;
+    char *outdir;
+    int save_queue;         /* save inputs with new coverage in outdir */
+} fuzz_t;
+
+/* what the signal handlers look at */
+static fuzz_t *active;
+static const unsigned char *cur_buf;
+static size_t cur_len;
+static volatile sig_atomic_t tick;
+
+/* instruction lengths by icode, for inserting whole instructions */
+static const int ins_len[] = {1, 1, 2, 10, 10, 10, 2, 9, 9, 1, 2, 2};
+
+/* xorshift64* */
+static unsigned long next_rand(fuzz_t *f)
+{
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return f->rng * 0x2545F4914F6CDD1DUL;
+}
+
+#define RAND(f, n) (next_rand(f) % (n))
+
+/* async-signal-safe: write 'len' bytes of 'buf' to 'outdir/name' */
+static int save_file(const char *outdir, const char *name, const unsigned char *buf, size_t len)
+{
+    char path[MAX_PATH];
+    size_t n = 0, k;
+    int fd;
+
+    for (k = 0; outdir[k] && n < MAX_PATH - 2; k++)
+        path[n++] = outdir[k];
+    path[n++] = '/';
+    for (k = 0; name[k] && n < MAX_PATH - 1; k++)
+        path[n++] = name[k];
+    path[n] = '\0';
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    for (n = 0; n < len; n += k)
+        if ((k = write(fd, buf + n, len - n)) <= 0)
+            break;
+    close(fd);
+    return n == len ? 0 : -1;
+}
+
+static void say(const char *s)
+{
+    if (write(2, s, strlen(s)) < 0)
+        return;
+}
+
+/* the simulator itself crashed: keep the input that did it */
+static void on_crash(int sig)
+{
+    say("y64fuzz: the simulator crashed, input saved as crash.bin\n");
+    if (active && cur_buf)
+        save_file(active->outdir, "crash.bin", cur_buf, cur_len);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* once a second: progress, and a hang if no execution finished lately */
+static void on_alarm(int sig)
+{
+    static long last_execs = -1;
+    static int stuck;
+
+    tick = 1;
+    if (!active)
+        return;
+    if (active->execs != last_execs)
+    {
+        last_execs = active->execs;
+        stuck = 0;
+        return;
+    }
+    if (++stuck < HANG_SECS)
+        return;
+    say("y64fuzz: the simulator hung, input saved as hang.bin\n");
+    if (cur_buf)
+        save_file(active->outdir, "hang.bin", cur_buf, cur_len);
+    _exit(2);
+}
+
+static void add_input(fuzz_t *f, const unsigned char *buf, size_t len)
+{
+    input_t *in;
+
+    if (f->ncorpus == f->cap)
+    {
+        f->cap = f->cap ? 2 * f->cap : 64;
+        f->corpus = (input_t *)realloc(f->corpus, f->cap * sizeof(input_t));
+    }
+    in = &f->corpus[f->ncorpus++];
+    in->buf = (unsigned char *)malloc(len ? len : 1);
+    memcpy(in->buf, buf, len);
+    in->len = len;
+}
+
+/* AFL style hit-count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static unsigned char bucket(unsigned char n)
+{
+    if (n < 4)
+        return n == 3 ? 4 : n;
+    if (n < 8)
+        return 8;
+    if (n < 16)
+        return 16;
+    if (n < 32)
+        return 32;
+    return n < 128 ? 64 : 128;
+}
+
+/*
+ * new_coverage: fold the edge map of the last run into 'virgin' and clear it
+ * return
+ *     whether it hit an edge, or an edge a number of times, not seen before
+ */
+static int new_coverage(fuzz_t *f)
+{
+    unsigned long *w = (unsigned long *)f->cov;
+    int i, k, found = 0;
+    unsigned char b;
+
+    for (i = 0; i < f->cov_size / 8; i++)
+    {
+        /* most of the map is untouched, skip it 64 bytes at a time */
+        if (!(i & 7) && !(w[i] | w[i + 1] | w[i + 2] | w[i + 3] |
+                          w[i + 4] | w[i + 5] | w[i + 6] | w[i + 7]))
+        {
+            i += 7;
+            continue;
+        }
+        if (!w[i])
+            continue;
+        for (k = i * 8; k < i * 8 + 8; k++)
+        {
+            if (!f->cov[k])
+                continue;
+            b = bucket(f->cov[k]);
+            if (b & ~f->virgin[k])
+            {
+                if (!f->virgin[k])
+                    f->edges++;
+                f->virgin[k] |= b;
+                found = 1;
+            }
+        }
+        w[i] = 0;
+    }
+    return found;
+}
+
+/* an 8-byte operand likely to hit a boundary */
+static long interesting_word(fuzz_t *f)
+{
+    long memsize = y64_memsize(f->y);
+
+    switch (RAND(f, 8))
+    {
+    case 0:
+        return 0;
+    case 1:
+        return -1;
+    case 2:
+        return memsize - 8;
+    case 3:
+        return memsize - 1 - RAND(f, 8);
+    case 4:
+        return memsize;
+    case 5:
+        return (long)(1UL << 63);
+    case 6:
+        return RAND(f, 64) - 32;
+    default:
+        return RAND(f, memsize) & ~7L;
+    }
+}
+
+/* a random but well-formed instruction at 'p', returns its length */
+static int random_inst(fuzz_t *f, unsigned char *p)
+{
+    int icode = RAND(f, 12);
+    int ifun = (icode == 6) ? RAND(f, 4) : (icode == 2 || icode == 7) ? RAND(f, 7) : 0;
+    int len = ins_len[icode];
+    long imm = interesting_word(f);
+    int i;
+
+    p[0] = (icode << 4) | ifun;
+    if (len == 2 || len == 10)
+        p[1] = (icode == 3 ? 0xF0 : RAND(f, 15) << 4) |
+               (icode == 10 || icode == 11 ? 0xF : RAND(f, 15));
+    for (i = 0; i < 8 && len > 2; i++, imm >>= 8)
+        p[len - 8 + i] = imm & 0xFF;
+    return len;
+}
+
+/* apply one random mutation to buf[0..*len), keeping *len <= f->max_len */
+static void mutate(fuzz_t *f, unsigned char *buf, size_t *len)
+{
+    size_t pos, from, n;
+    unsigned char ins[10];
+    input_t *other;
+    long word;
+    int k;
+
+    if (*len == 0)
+    {
+        *len = random_inst(f, buf);
+        return;
+    }
+    pos = RAND(f, *len);
+    switch (RAND(f, 9))
+    {
+    case 0: /* flip a bit */
+        buf[pos] ^= 1 << RAND(f, 8);
+        break;
+    case 1: /* a random byte */
+        buf[pos] = RAND(f, 256);
+        break;
+    case 2: /* a valid opcode, or a register pair */
+        buf[pos] = RAND(f, 2) ? (RAND(f, 12) << 4) | RAND(f, 7) : RAND(f, 256) | 0x0F;
+        break;
+    case 3: /* a boundary operand */
+        word = interesting_word(f);
+        for (k = 0; k < 8 && pos + k < *len; k++, word >>= 8)
+            buf[pos + k] = word & 0xFF;
+        break;
+    case 4: /* nudge a byte */
+        buf[pos] += RAND(f, 33) - 16;
+        break;
+    case 5: /* copy a chunk over another */
+        from = RAND(f, *len);
+        n = RAND(f, *len - (pos > from ? pos : from)) + 1;
+        memmove(buf + pos, buf + from, n);
+        break;
+    case 6: /* insert an instruction */
+        n = random_inst(f, ins);
+        if (*len + n > f->max_len)
+            break;
+        memmove(buf + pos + n, buf + pos, *len - pos);
+        memcpy(buf + pos, ins, n);
+        *len += n;
+        break;
+    case 7: /* delete a chunk */
+        n = RAND(f, *len - pos) + 1;
+        memmove(buf + pos, buf + pos + n, *len - pos - n);
+        *len -= n;
+        break;
+    default: /* splice in the tail of another input */
+        other = &f->corpus[RAND(f, f->ncorpus)];
+        if (!other->len)
+            break;
+        from = RAND(f, other->len);
+        n = other->len - from;
+        if (pos + n > f->max_len)
+            n = f->max_len - pos;
+        memcpy(buf + pos, other->buf + from, n);
+        if (pos + n > *len)
+            *len = pos + n;
+        break;
+    }
+}
+
+/*
+ * same_run: run the input on the other engines as well, and compare status,
+ *     steps, PC, registers, cc and memory with the interpreter's
+ */
+static int same_run(fuzz_t *f, const unsigned char *buf, size_t len, int st, int steps)
+{
+    long memsize = y64_memsize(f->y);
+    int i, r, st2, steps2;
+
+    y64_read(f->y, 0, f->mem[0], memsize);
+    for (i = 0; i < 2; i++)
+    {
+        y64_reset(f->ref[i]);
+        y64_write(f->ref[i], 0, buf, len);
+        st2 = y64_run(f->ref[i], f->max_steps, &steps2);
+        if (st2 != st || steps2 != steps || y64_get_pc(f->ref[i]) != y64_get_pc(f->y) ||
+            y64_get_cc(f->ref[i]) != y64_get_cc(f->y))
+            return 0;
+        for (r = Y64_RAX; r < Y64_NREGS; r++)
+            if (y64_get_reg(f->ref[i], r) != y64_get_reg(f->y, r))
+                return 0;
+        y64_read(f->ref[i], 0, f->mem[1], memsize);
+        if (memcmp(f->mem[0], f->mem[1], memsize))
+            return 0;
+    }
+    return 1;
+}
+
+/* run one input from the snapshot, returns whether it found new coverage */
+static int run_input(fuzz_t *f, const unsigned char *buf, size_t len)
+{
+    char name[64];
+    int st, steps;
+
+    cur_buf = buf;
+    cur_len = len;
+    y64_reset(f->y);
+    y64_write(f->y, 0, buf, len);
+    st = y64_run(f->y, f->max_steps, &steps);
+    f->stats[st]++;
+    f->execs++;
+    if (f->ref[0] && !same_run(f, buf, len, st, steps))
+    {
+        sprintf(name, "diff-%ld.bin", f->diffs++);
+        err_print("Engines disagree on input %ld, saved as %s", f->execs, name);
+        save_file(f->outdir, name, buf, len);
+    }
+    if (!new_coverage(f))
+        return 0;
+    if (f->save_queue)
+    {
+        sprintf(name, "id-%06d.bin", f->ncorpus);
+        save_file(f->outdir, name, buf, len);
+    }
+    return 1;
+}
+
+static y64_t *new_image(long memsize, int engine)
+{
+    y64_t *y = y64_create(memsize);
+    if (!y)
+        return NULL;
+    y64_set_engine(y, engine);
+    y64_snapshot(y);
+    return y;
+}
+
+static void print_stats(fuzz_t *f, double secs)
+{
+    printf("execs %ld (%.0f/s)  corpus %d  edges %ld  HLT %ld  ADR %ld  INS %ld  "
+           "out of steps %ld  diffs %ld\n",
+           f->execs, secs > 0 ? f->execs / secs : 0.0, f->ncorpus, f->edges,
+           f->stats[Y64_HLT], f->stats[Y64_ADR], f->stats[Y64_INS], f->stats[Y64_AOK], f->diffs);
+    fflush(stdout);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-n execs] [-t max_steps] [-m memsize] [-l max_len] [-S seed]\n"
+           "       [-d] [-o dir] seed.bin ...\n", pname);
+    printf("   -n execs       Stop after this many executions (default 1000000, 0: never)\n");
+    printf("   -t max_steps   Step budget of one execution (default 1000)\n");
+    printf("   -m memsize     Bytes of Y64 memory, K, M or G suffix allowed (default 8K)\n");
+    printf("   -l max_len     Largest input in bytes (default: memsize)\n");
+    printf("   -S seed        Random seed (default 1)\n");
+    printf("   -d             Also run every input on the threaded and JIT engines and\n"
+           "                  save it as diff-N.bin when they disagree\n");
+    printf("   -o dir         Save inputs with new coverage there as id-N.bin; crash.bin,\n"
+           "                  hang.bin and diff-N.bin go there too (default: .)\n");
+    printf("   -h             Print this message\n");
+    printf("\nBuild with -fsanitize=address and run with ASAN_OPTIONS=abort_on_error=1\n"
+           "to catch (and save) out-of-bounds accesses in the simulator.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    static fuzz_t fz;
+    fuzz_t *f = &fz;
+    long max_execs = 1000000, memsize = 1 << 13;
+    struct itimerval it = {{1, 0}, {1, 0}};
+    unsigned char *buf;
+    size_t len;
+    FILE *seed;
+    char *end;
+    double start;
+    int c, i, k, nmut;
+    int cross = 0;
+
+    f->max_steps = 1000;
+    f->rng = 1;
+    f->outdir = ".";
+    while ((c = getopt(argc, argv, "n:t:m:l:S:do:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            max_execs = atol(optarg);
+            break;
+        case 't':
+            f->max_steps = atoi(optarg);
+            break;
+        case 'm':
+            memsize = strtol(optarg, &end, 0);
+            if (*end == 'K' || *end == 'k')
+                memsize <<= 10;
+            else if (*end == 'M' || *end == 'm')
+                memsize <<= 20;
+            else if (*end == 'G' || *end == 'g')
+                memsize <<= 30;
+            if (memsize <= 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            f->max_len = strtol(optarg, NULL, 0);
+            break;
+        case 'S':
+            f->rng = strtoul(optarg, NULL, 0) | 1;
+            break;
+        case 'd':
+            cross = 1;
+            break;
+        case 'o':
+            f->outdir = optarg;
+            f->save_queue = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || f->max_steps <= 0)
+        usage(argv[0]);
+
+    f->y = new_image(memsize, Y64_INTERP);
+    if (!f->y)
+    {
+        err_print("Bad memory size %ld", memsize);
+        return -1;
+    }
+    /* PCs are below memsize, so are their edges: no bigger map is needed */
+    for (f->cov_size = 64; f->cov_size < memsize && f->cov_size < COV_MAX; f->cov_size *= 2)
+        ;
+    y64_coverage(f->y, f->cov, f->cov_size);
+    if (!f->max_len || f->max_len > (size_t)memsize)
+        f->max_len = memsize;
+    if (cross)
+    {
+        f->ref[0] = new_image(memsize, Y64_THREADED);
+        f->ref[1] = new_image(memsize, Y64_JIT);
+        f->mem[0] = (unsigned char *)malloc(memsize);
+        f->mem[1] = (unsigned char *)malloc(memsize);
+    }
+    buf = (unsigned char *)malloc(f->max_len);
+
+    for (i = optind; i < argc && f->ncorpus < MAX_SEEDS; i++)
+    {
+        seed = fopen(argv[i], "rb");
+        if (!seed)
+        {
+            err_print("Can't open seed '%s'", argv[i]);
+            return -1;
+        }
+        len = fread(buf, 1, f->max_len, seed);
+        fclose(seed);
+        add_input(f, buf, len);
+    }
+
+    active = f;
+    signal(SIGSEGV, on_crash);
+    signal(SIGBUS, on_crash);
+    signal(SIGFPE, on_crash);
+    signal(SIGILL, on_crash);
+    signal(SIGABRT, on_crash);
+    signal(SIGALRM, on_alarm);
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    /* the seeds themselves set the initial coverage */
+    for (i = 0; i < f->ncorpus; i++)
+        run_input(f, f->corpus[i].buf, f->corpus[i].len);
+
+    start = now();
+    while (!max_execs || f->execs < max_execs)
+    {
+        input_t *in = &f->corpus[RAND(f, f->ncorpus)];
+
+        memcpy(buf, in->buf, in->len);
+        len = in->len;
+        nmut = 1 + RAND(f, HAVOC_MAX);
+        for (k = 0; k < nmut; k++)
+            mutate(f, buf, &len);
+        if (run_input(f, buf, len))
+            add_input(f, buf, len);
+        if (tick)
+        {
+            tick = 0;
+            print_stats(f, now() - start);
+        }
+    }
+    print_stats(f, now() - start);
+    return f->diffs ? 1 : 0;
+}
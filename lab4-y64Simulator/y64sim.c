@@ -2,19 +2,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "y64sim.h"
 
 #define err_print(_s, _a...) \
     fprintf(stdout, _s "\n", _a);
 
-typedef enum
-{
-    STAT_AOK,
-    STAT_HLT,
-    STAT_ADR,
-    STAT_INS
-} stat_t;
+/* fault messages of a running image go to its own output (if any) */
+#define sim_err_print(_sim, _s, _a...) \
+    { if ((_sim)->out) fprintf((_sim)->out, _s "\n", _a); }
 
 char *stat_names[] = {"AOK", "HLT", "ADR", "INS"};
 
@@ -44,11 +49,93 @@ char *cc_name(cc_t c)
         return cc_names[c];
 }
 
+/* whether [addr, addr+n) lies inside memory (one unsigned compare) */
+#define IN_MEM(m, addr, n) ((unsigned long)(addr) <= (unsigned long)((m)->len - (n)))
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LE 1 /* a long_t in memory has the same layout as in Y64 */
+#else
+#define HOST_LE 0
+#endif
+
+/* little-endian 8-byte load/store from/to host memory */
+static inline long_t load_le(byte_t *p)
+{
+    int i;
+    long_t val = 0;
+    if (HOST_LE)
+    {
+        memcpy(&val, p, 8);
+        return val;
+    }
+    for (i = 0; i < 8; i++)
+        val = val | ((long_t)p[i]) << (8 * i);
+    return val;
+}
+
+static inline void store_le(byte_t *p, long_t val)
+{
+    int i;
+    if (HOST_LE)
+    {
+        memcpy(p, &val, 8);
+        return;
+    }
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = val & 0xFF;
+        val >>= 8;
+    }
+}
+
+/*
+ * get_page: find the page holding 'addr' in a paged image
+ * args
+ *     alloc: allocate the page (zero-filled) if it was never touched
+ *
+ * return
+ *     the page, NULL if it was never touched and 'alloc' is FALSE
+ */
+page_t *get_page(mem_t *m, long_t addr, bool_t alloc)
+{
+    page_t **dir = m->dir[addr >> DIR_SHIFT];
+    page_t **pg;
+
+    if (!dir)
+    {
+        if (!alloc)
+            return NULL;
+        dir = (page_t **)calloc(DIR_PAGES, sizeof(page_t *));
+        m->dir[addr >> DIR_SHIFT] = dir;
+    }
+    pg = &dir[(addr >> PAGE_SHIFT) & (DIR_PAGES - 1)];
+    if (!*pg && alloc)
+        *pg = (page_t *)calloc(1, sizeof(page_t));
+    return *pg;
+}
+
+/* host address of the page (or flat image) bytes at 'addr', NULL if untouched */
+byte_t *page_data(mem_t *m, long_t addr)
+{
+    page_t *pg;
+    if (m->data)
+        return m->data + addr;
+    pg = get_page(m, addr, FALSE);
+    return pg ? pg->data + (addr & PAGE_MASK) : NULL;
+}
+
 bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest)
 {
-    if (addr < 0 || addr >= m->len)
+    page_t *pg;
+    if (!IN_MEM(m, addr, 1))
         return FALSE;
-    *dest = m->data[addr];
+    if (m->data)
+    {
+        *dest = m->data[addr];
+        return TRUE;
+    }
+    pg = get_page(m, addr, FALSE);
+    *dest = pg ? pg->data[addr & PAGE_MASK] : 0;
     return TRUE;
 }
 
@@ -56,84 +143,481 @@ bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
 {
     int i;
     long_t val;
-    if (addr < 0 || addr + 8 > m->len)
+    byte_t b = 0;
+    page_t *pg;
+    if (!IN_MEM(m, addr, 8))
         return FALSE;
+    if (m->data)
+    {
+        *dest = load_le(m->data + addr);
+        return TRUE;
+    }
+    if ((addr & PAGE_MASK) <= PAGE_SIZE - 8)
+    {
+        pg = get_page(m, addr, FALSE);
+        *dest = pg ? load_le(pg->data + (addr & PAGE_MASK)) : 0;
+        return TRUE;
+    }
+    /* crosses a page boundary */
     val = 0;
     for (i = 0; i < 8; i++)
-        val = val | ((long_t)m->data[addr + i]) << (8 * i);
+    {
+        get_byte_val(m, addr + i, &b);
+        val = val | ((long_t)b) << (8 * i);
+    }
     *dest = val;
     return TRUE;
 }
 
+#define IS_DIRTY(map, blk) ((map)[(blk) >> 3] & (1 << ((blk) & 7)))
+
+/*
+ * mark_dirty: flag the blocks of [addr, addr+len) as written, saving their
+ *     contents the first time (call before the write)
+ */
+void mark_dirty(mem_t *m, long_t addr, int len)
+{
+    long_t blk, off;
+    page_t *pg;
+
+    for (blk = addr / BLK_SIZE; blk <= (addr + len - 1) / BLK_SIZE; blk++)
+    {
+        if (m->data)
+        {
+            if (IS_DIRTY(m->dirty, blk))
+                continue;
+            m->dirty[blk >> 3] |= 1 << (blk & 7);
+            memcpy(m->saved + blk * BLK_SIZE, m->data + blk * BLK_SIZE, BLK_SIZE);
+            continue;
+        }
+        pg = get_page(m, blk * BLK_SIZE, TRUE);
+        off = (blk * BLK_SIZE) & PAGE_MASK;
+        if (IS_DIRTY(pg->dirty, off / BLK_SIZE))
+            continue;
+        if (!pg->saved)
+            pg->saved = (byte_t *)malloc(PAGE_SIZE);
+        pg->dirty[off / BLK_SIZE >> 3] |= 1 << (off / BLK_SIZE & 7);
+        memcpy(pg->saved + off, pg->data + off, BLK_SIZE);
+    }
+}
+
+/* set (flag = 1) or clear (flag = 0) the codemap of [addr, addr+len) */
+void set_code_flags(mem_t *m, long_t addr, long_t len, byte_t flag)
+{
+    page_t *pg;
+
+    if (m->data)
+    {
+        memset(m->codemap + addr, flag, len);
+        return;
+    }
+    for (; len > 0; addr++, len--)
+    {
+        pg = get_page(m, addr, flag);
+        if (!pg)
+            continue;
+        if (!pg->code)
+        {
+            if (!flag)
+                continue;
+            pg->code = (byte_t *)calloc(PAGE_SIZE, 1);
+        }
+        pg->code[addr & PAGE_MASK] = flag;
+    }
+}
+
+/*
+ * invalidate_code: drop cached decodes (and superinstructions) overlapping
+ *     [addr, addr+len)
+ *     (only bytes flagged in codemap belong to such instructions)
+ */
+void invalidate_code(mem_t *m, long_t addr, int len)
+{
+    long_t pc;
+
+    for (pc = addr - (MAX_FUSELEN - 1); pc < addr + len; pc++)
+        if (m->dcache[DCACHE_IDX(pc)].pc == pc)
+            m->dcache[DCACHE_IDX(pc)].pc = -1;
+    set_code_flags(m, addr, len, 0);
+    m->code_gen++;
+}
+
 bool_t set_byte_val(mem_t *m, long_t addr, byte_t val)
 {
-    if (addr < 0 || addr >= m->len)
+    page_t *pg;
+    if (!IN_MEM(m, addr, 1))
         return FALSE;
-    m->data[addr] = val;
+    if (m->track)
+        mark_dirty(m, addr, 1);
+    if (m->data)
+    {
+        if (m->codemap && m->codemap[addr])
+            invalidate_code(m, addr, 1);
+        m->data[addr] = val;
+        return TRUE;
+    }
+    pg = get_page(m, addr, TRUE);
+    if (pg->code && pg->code[addr & PAGE_MASK])
+        invalidate_code(m, addr, 1);
+    pg->data[addr & PAGE_MASK] = val;
     return TRUE;
 }
 
 bool_t set_long_val(mem_t *m, long_t addr, long_t val)
 {
     int i;
-    if (addr < 0 || addr + 8 > m->len)
+    byte_t *code = NULL;
+    byte_t *data;
+    page_t *pg;
+    if (!IN_MEM(m, addr, 8))
         return FALSE;
-    for (i = 0; i < 8; i++)
+    if (m->data)
     {
-        m->data[addr + i] = val & 0xFF;
-        val >>= 8;
+        code = m->codemap ? m->codemap + addr : NULL;
+        data = m->data + addr;
+        if (m->track)
+            mark_dirty(m, addr, 8);
+    }
+    else if ((addr & PAGE_MASK) <= PAGE_SIZE - 8)
+    {
+        if (m->track)
+            mark_dirty(m, addr, 8);
+        pg = get_page(m, addr, TRUE);
+        code = pg->code ? pg->code + (addr & PAGE_MASK) : NULL;
+        data = pg->data + (addr & PAGE_MASK);
+    }
+    else
+    {
+        /* crosses a page boundary */
+        for (i = 0; i < 8; i++)
+        {
+            set_byte_val(m, addr + i, val & 0xFF);
+            val >>= 8;
+        }
+        return TRUE;
+    }
+    if (code)
+    {
+        long_t flags;
+        memcpy(&flags, code, 8);
+        if (flags)
+            invalidate_code(m, addr, 8);
     }
+    store_le(data, val);
     return TRUE;
 }
 
-mem_t *init_mem(int len)
+/* images up to FLAT_MAX bytes are one flat buffer, larger ones are paged */
+mem_t *init_mem(long_t len)
 {
     mem_t *m = (mem_t *)malloc(sizeof(mem_t));
     len = ((len + BLK_SIZE - 1) / BLK_SIZE) * BLK_SIZE;
     m->len = len;
-    m->data = (byte_t *)calloc(len, 1);
+    m->data = NULL;
+    m->dir = NULL;
+    m->ndir = 0;
+    if (len <= FLAT_MAX)
+        m->data = (byte_t *)calloc(len, 1);
+    else
+    {
+        m->ndir = (len + (1L << DIR_SHIFT) - 1) >> DIR_SHIFT;
+        m->dir = (page_t ***)calloc(m->ndir, sizeof(page_t **));
+    }
+    m->codemap = NULL;
+    m->dcache = NULL;
+    m->code_gen = 0;
+    m->track = FALSE;
+    m->dirty = NULL;
+    m->saved = NULL;
 
     return m;
 }
 
+/*
+ * track_mem: take the current contents as the baseline of diff_dirty()
+ *     (nothing is copied now, blocks are saved on their first write)
+ */
+void track_mem(mem_t *m)
+{
+    long_t d, p;
+    page_t *pg;
+
+    m->track = TRUE;
+    m->code_gen++; /* native code compiled without dirty checks goes */
+    if (m->data)
+    {
+        if (!m->dirty)
+        {
+            m->dirty = (byte_t *)calloc(DIRTY_BYTES(m->len), 1);
+            m->saved = (byte_t *)malloc(m->len);
+        }
+        else
+            memset(m->dirty, 0, DIRTY_BYTES(m->len));
+        return;
+    }
+    for (d = 0; d < m->ndir; d++)
+        for (p = 0; m->dir[d] && p < DIR_PAGES; p++)
+            if ((pg = m->dir[d][p]) != NULL)
+                memset(pg->dirty, 0, sizeof(pg->dirty));
+}
+
+/* attach an (empty) decoded instruction cache to the memory image */
+void init_dcache(mem_t *m)
+{
+    int i;
+    if (m->data)
+        m->codemap = (byte_t *)calloc(m->len, 1);
+    m->dcache = (dinst_t *)malloc(DCACHE_SIZE * sizeof(dinst_t));
+    for (i = 0; i < DCACHE_SIZE; i++)
+        m->dcache[i].pc = -1;
+}
+
 void free_mem(mem_t *m)
 {
-    free((void *)m->data);
+    long_t d, p;
+    page_t *pg;
+
+    for (d = 0; d < m->ndir; d++)
+    {
+        if (!m->dir[d])
+            continue;
+        for (p = 0; p < DIR_PAGES; p++)
+        {
+            pg = m->dir[d][p];
+            if (!pg)
+                continue;
+            if (pg->code)
+                free((void *)pg->code);
+            if (pg->saved)
+                free((void *)pg->saved);
+            free((void *)pg);
+        }
+        free((void *)m->dir[d]);
+    }
+    if (m->dir)
+        free((void *)m->dir);
+    if (m->dcache)
+    {
+        if (m->codemap)
+            free((void *)m->codemap);
+        free((void *)m->dcache);
+    }
+    if (m->dirty)
+    {
+        free((void *)m->dirty);
+        free((void *)m->saved);
+    }
+    if (m->data)
+        free((void *)m->data);
     free((void *)m);
 }
 
-mem_t *dup_mem(mem_t *oldm)
+static bool_t same_scalar(const byte_t *a, const byte_t *b, long_t n)
+{
+    unsigned long x, y;
+    long_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            return FALSE;
+    }
+    return !memcmp(a + i, b + i, n - i);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static bool_t same_sse2(const byte_t *a, const byte_t *b, long_t n)
 {
-    mem_t *newm = init_mem(oldm->len);
-    memcpy(newm->data, oldm->data, oldm->len);
-    return newm;
+    __m128i x;
+    long_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        x = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                           _mm_loadu_si128((const __m128i *)(b + i))),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+                           _mm_loadu_si128((const __m128i *)(b + i + 16))));
+        if (_mm_movemask_epi8(x) != 0xFFFF)
+            return FALSE;
+    }
+    return same_scalar(a + i, b + i, n - i);
 }
 
-bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile)
+__attribute__((target("avx2")))
+static bool_t same_avx2(const byte_t *a, const byte_t *b, long_t n)
 {
-    long_t pos;
-    int len = oldm->len;
-    bool_t diff = FALSE;
+    __m256i x;
+    long_t i;
+
+    /* 64 bytes (two BLK_SIZE blocks) per test */
+    for (i = 0; i + 64 <= n; i += 64)
+    {
+        x = _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                             _mm256_loadu_si256((const __m256i *)(b + i))),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                             _mm256_loadu_si256((const __m256i *)(b + i + 32))));
+        if (!_mm256_testz_si256(x, x))
+            return FALSE;
+    }
+    if (i + 32 <= n)
+    {
+        x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                             _mm256_loadu_si256((const __m256i *)(b + i)));
+        if (!_mm256_testz_si256(x, x))
+            return FALSE;
+        i += 32;
+    }
+    return same_scalar(a + i, b + i, n - i);
+}
+#endif
+
+/*
+ * same_bytes: are the n bytes at 'a' and 'b' the same? Tests 64 bytes at a
+ *     time with AVX2, 32 with SSE2 and 8 without, the widest the CPU has
+ *     (picked once, before any thread). diff_blocks() and diff_reg() look
+ *     at a quadword at a time only where it says they differ.
+ */
+static bool_t (*same_bytes)(const byte_t *a, const byte_t *b, long_t n) = same_scalar;
+
+__attribute__((constructor))
+static void pick_same_bytes(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        same_bytes = same_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        same_bytes = same_sse2;
+#endif
+}
 
-    if (newm->len < len)
-        len = newm->len;
+/* diff the dirty blocks (dirty bitmap 'map') of one flat image or page */
+static bool_t diff_blocks(byte_t *map, long_t nblks, byte_t *saved, byte_t *data,
+                          long_t base, FILE *outfile, bool_t diff)
+{
+    long_t blk, pos;
+    long_t ov, nv;
 
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8)
+    for (blk = 0; (!diff || outfile) && blk < nblks; blk++)
     {
-        long_t ov = 0;
-        long_t nv = 0;
-        get_long_val(oldm, pos, &ov);
-        get_long_val(newm, pos, &nv);
-        if (nv != ov)
+        /* skip clean runs a byte (8 blocks) at a time */
+        if (!(blk & 7) && !map[blk >> 3])
         {
-            diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", pos, ov, nv);
+            blk += 7;
+            continue;
+        }
+        /* a byte of dirty blocks that are all unchanged */
+        if (!(blk & 7) && map[blk >> 3] == 0xFF && blk + 8 <= nblks &&
+            same_bytes(saved + blk * BLK_SIZE, data + blk * BLK_SIZE, 8 * BLK_SIZE))
+        {
+            blk += 7;
+            continue;
+        }
+        if (!IS_DIRTY(map, blk) ||
+            same_bytes(saved + blk * BLK_SIZE, data + blk * BLK_SIZE, BLK_SIZE))
+            continue;
+        for (pos = blk * BLK_SIZE; (!diff || outfile) && pos < (blk + 1) * BLK_SIZE; pos += 8)
+        {
+            ov = load_le(saved + pos);
+            nv = load_le(data + pos);
+            if (nv != ov)
+            {
+                diff = TRUE;
+                if (outfile)
+                    fprintf(outfile, "0x%.16lx:\t0x%.16lx\t0x%.16lx\n", base + pos, ov, nv);
+            }
         }
     }
     return diff;
 }
 
+/*
+ * diff_dirty: print (if 'outfile') the quadwords that differ from the
+ *     contents at track_mem(), only the blocks written since then are
+ *     compared
+ *
+ * return
+ *     TRUE: memory differs
+ */
+bool_t diff_dirty(mem_t *m, FILE *outfile)
+{
+    long_t d, p;
+    page_t *pg;
+    bool_t diff = FALSE;
+
+    if (m->data)
+        return diff_blocks(m->dirty, m->len / BLK_SIZE, m->saved, m->data, 0, outfile, FALSE);
+
+    for (d = 0; (!diff || outfile) && d < m->ndir; d++)
+        for (p = 0; m->dir[d] && (!diff || outfile) && p < DIR_PAGES; p++)
+        {
+            pg = m->dir[d][p];
+            if (pg && pg->saved)
+                diff = diff_blocks(pg->dirty, PAGE_SIZE / BLK_SIZE, pg->saved, pg->data,
+                                   (d << DIR_SHIFT) | (p << PAGE_SHIFT), outfile, diff);
+        }
+    return diff;
+}
+
+/* put back the saved contents of the dirty blocks in 'map' */
+static void reset_blocks(mem_t *m, byte_t *map, long_t nblks, byte_t *saved, byte_t *data,
+                         byte_t *code, long_t base)
+{
+    long_t blk, pos;
+    int i;
+
+    for (blk = 0; blk < nblks; blk++)
+    {
+        if (!(blk & 7) && !map[blk >> 3])
+        {
+            blk += 7;
+            continue;
+        }
+        if (!IS_DIRTY(map, blk))
+            continue;
+        pos = blk * BLK_SIZE;
+        for (i = 0; code && i < BLK_SIZE; i++)
+            if (code[pos + i])
+            {
+                invalidate_code(m, base + pos, BLK_SIZE);
+                break;
+            }
+        memcpy(data + pos, saved + pos, BLK_SIZE);
+    }
+    memset(map, 0, DIRTY_BYTES(nblks * BLK_SIZE));
+}
+
+/*
+ * reset_dirty: undo every write since track_mem() (only the dirty blocks are
+ *     copied), tracking goes on from there
+ */
+void reset_dirty(mem_t *m)
+{
+    long_t d, p;
+    page_t *pg;
+
+    if (!m->track)
+        return;
+    if (m->data)
+    {
+        reset_blocks(m, m->dirty, m->len / BLK_SIZE, m->saved, m->data, m->codemap, 0);
+        return;
+    }
+    for (d = 0; d < m->ndir; d++)
+        for (p = 0; m->dir[d] && p < DIR_PAGES; p++)
+        {
+            pg = m->dir[d][p];
+            if (pg && pg->saved)
+                reset_blocks(m, pg->dirty, PAGE_SIZE / BLK_SIZE, pg->saved, pg->data, pg->code,
+                             (d << DIR_SHIFT) | (p << PAGE_SHIFT));
+        }
+}
+
 reg_t reg_table[REG_NONE] = {
     {"%rax", REG_RAX},
     {"%rcx", REG_RCX},
@@ -151,100 +635,285 @@ reg_t reg_table[REG_NONE] = {
     {"%r13", REG_R13},
     {"%r14", REG_R14}};
 
-long_t get_reg_val(mem_t *r, regid_t id)
+long_t get_reg_val(long_t *r, regid_t id)
 {
-    long_t val = 0;
     if (id >= REG_NONE)
         return 0;
-    get_long_val(r, id * 8, &val);
-    return val;
+    return r[id];
 }
 
-void set_reg_val(mem_t *r, regid_t id, long_t val)
+void set_reg_val(long_t *r, regid_t id, long_t val)
 {
     if (id < REG_NONE)
-        set_long_val(r, id * 8, val);
+        r[id] = val;
 }
 
-mem_t *init_reg()
+bool_t diff_reg(long_t *oldr, long_t *newr, FILE *outfile)
 {
-    return init_mem(REG_SIZE);
+    int id;
+    bool_t diff = FALSE;
+
+    if (same_bytes((byte_t *)oldr, (byte_t *)newr, REG_NONE * sizeof(long_t)))
+        return FALSE;
+    for (id = 0; (!diff || outfile) && id < REG_NONE; id++)
+    {
+        if (newr[id] != oldr[id])
+        {
+            diff = TRUE;
+            if (outfile)
+                fprintf(outfile, "%s:\t0x%.16lx\t0x%.16lx\n",
+                        reg_table[id].name, oldr[id], newr[id]);
+        }
+    }
+    return diff;
 }
 
-void free_reg(mem_t *r)
+/*
+ * Branch predictors
+ */
+
+static bool_t predict_taken(bpred_t *bp, long_t pc, long_t target)
 {
-    free_mem(r);
+    return TRUE;
 }
 
-mem_t *dup_reg(mem_t *oldr)
+/* backward taken, forward not taken */
+static bool_t predict_btfnt(bpred_t *bp, long_t pc, long_t target)
 {
-    return dup_mem(oldr);
+    return target <= pc;
 }
 
-bool_t diff_reg(mem_t *oldr, mem_t *newr, FILE *outfile)
+static long_t bht_idx(bpred_t *bp, long_t pc)
 {
-    long_t pos;
-    int len = oldr->len;
-    bool_t diff = FALSE;
+    return (pc ^ bp->hist) & ((1 << BHT_BITS) - 1);
+}
+
+static bool_t predict_bht(bpred_t *bp, long_t pc, long_t target)
+{
+    return bp->bht[bht_idx(bp, pc)] >= 2;
+}
+
+/* saturating 2-bit counter, then shift the outcome into the history */
+static void update_bht(bpred_t *bp, long_t pc, bool_t taken)
+{
+    byte_t *c = &bp->bht[bht_idx(bp, pc)];
+
+    if (taken && *c < 3)
+        (*c)++;
+    else if (!taken && *c > 0)
+        (*c)--;
+    if (bp->hist_bits)
+        bp->hist = (bp->hist << 1 | taken) & ((1 << bp->hist_bits) - 1);
+}
 
-    if (newr->len < len)
-        len = newr->len;
+bpsim_t *new_bpsim()
+{
+    static bpred_t preds[NUM_BPRED] = {
+        {"always-taken", predict_taken, NULL, 0},
+        {"btfnt", predict_btfnt, NULL, 0},
+        {"bimodal", predict_bht, update_bht, 0},
+        {"gshare", predict_bht, update_bht, BHT_BITS}};
+    bpsim_t *b = (bpsim_t *)calloc(1, sizeof(bpsim_t));
+    int i;
 
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8)
-    {
-        long_t ov = 0;
-        long_t nv = 0;
-        get_long_val(oldr, pos, &ov);
-        get_long_val(newr, pos, &nv);
-        if (nv != ov)
+    memcpy(b->preds, preds, sizeof(preds));
+    for (i = 0; i < NUM_BPRED; i++)
+        if (b->preds[i].update)
         {
-            diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "%s:\t0x%.16lx\t0x%.16lx\n",
-                        reg_table[pos / 8].name, ov, nv);
+            /* start weakly taken */
+            b->preds[i].bht = (byte_t *)malloc(1 << BHT_BITS);
+            memset(b->preds[i].bht, 2, 1 << BHT_BITS);
         }
+    return b;
+}
+
+void free_bpsim(bpsim_t *b)
+{
+    int i;
+    for (i = 0; i < NUM_BPRED; i++)
+        free((void *)b->preds[i].bht);
+    free((void *)b);
+}
+
+/*
+ * Cache model
+ */
+
+cache_t *new_caches(int cfg[NUM_CACHE][3])
+{
+    cache_t *c = (cache_t *)calloc(NUM_CACHE, sizeof(cache_t));
+    int i;
+
+    for (i = 0; i < NUM_CACHE; i++)
+    {
+        c[i].s = cfg[i][0];
+        c[i].E = cfg[i][1];
+        c[i].b = cfg[i][2];
+        c[i].lines = (cline_t *)calloc((1L << c[i].s) * c[i].E, sizeof(cline_t));
     }
-    return diff;
+    c[C_L1I].next = c[C_L1D].next = &c[C_L2];
+    return c;
+}
+
+void free_caches(cache_t *c)
+{
+    int i;
+    for (i = 0; i < NUM_CACHE; i++)
+        free((void *)c[i].lines);
+    free((void *)c);
+}
+
+undo_t *new_undo(long_t cap)
+{
+    undo_t *u = (undo_t *)calloc(1, sizeof(undo_t));
+    u->cap = cap > 0 ? cap : 1;
+    u->recs = (undo_rec_t *)malloc(u->cap * sizeof(undo_rec_t));
+    return u;
+}
+
+void free_undo(undo_t *u)
+{
+    free((void *)u->recs);
+    free((void *)u);
+}
+
+prof_t *new_prof()
+{
+    prof_t *p = (prof_t *)calloc(1, sizeof(prof_t));
+    return p;
+}
+
+void free_prof(prof_t *p)
+{
+    free((void *)p->pcs.ents);
+    free((void *)p->calls.ents);
+    free((void *)p);
 }
 
 /* create an y64 image with registers and memory */
-y64sim_t *new_y64sim(int slen)
+y64sim_t *new_y64sim(long_t slen)
 {
     y64sim_t *sim = (y64sim_t *)malloc(sizeof(y64sim_t));
     sim->pc = 0;
-    sim->r = init_reg();
+    memset(sim->regs, 0, sizeof(sim->regs));
     sim->m = init_mem(slen);
+    init_dcache(sim->m);
     sim->cc = DEFAULT_CC;
+    sim->lcc.op = -1;
+    sim->tcache = NULL;
+    sim->tc_gen = 0;
+    sim->jit = NULL;
+    sim->prof = NULL;
+    sim->pipe = NULL;
+    sim->bp = NULL;
+    sim->caches = NULL;
+    sim->trace = NULL;
+    sim->undo = NULL;
+    sim->out = stdout;
+    sim->engine = E_INTERP;
+    sim->mem_cb = NULL;
+    sim->halt_cb = NULL;
+    sim->base_pc = 0;
+    memset(sim->base_regs, 0, sizeof(sim->base_regs));
+    sim->base_cc = DEFAULT_CC;
+    sim->cov = NULL;
+    sim->cov_prev = 0;
     return sim;
 }
 
 void free_y64sim(y64sim_t *sim)
 {
-    free_reg(sim->r);
     free_mem(sim->m);
+    if (sim->tcache)
+        free((void *)sim->tcache);
+    if (sim->jit)
+    {
+        munmap(sim->jit->buf, JIT_BUF_SIZE);
+        free((void *)sim->jit->blocks);
+        free((void *)sim->jit);
+    }
+    if (sim->prof)
+        free_prof(sim->prof);
+    if (sim->pipe)
+        free((void *)sim->pipe);
+    if (sim->bp)
+        free_bpsim(sim->bp);
+    if (sim->caches)
+        free_caches(sim->caches);
+    if (sim->undo)
+        free_undo(sim->undo);
     free((void *)sim);
 }
 
 /* load binary code and data from file to memory image */
 int load_binfile(mem_t *m, FILE *f)
 {
-    int flen;
+    long_t flen;
+    long_t i, n, want;
+    byte_t buf[PAGE_SIZE];
 
     clearerr(f);
-    flen = fread(m->data, sizeof(byte_t), m->len, f);
+    if (m->data)
+        flen = fread(m->data, sizeof(byte_t), m->len, f);
+    else
+    {
+        /* page by page, all-zero pages stay untouched */
+        for (flen = 0; flen < m->len; flen += n)
+        {
+            want = m->len - flen < PAGE_SIZE ? m->len - flen : PAGE_SIZE;
+            n = fread(buf, sizeof(byte_t), want, f);
+            for (i = 0; i < n; i++)
+                if (buf[i])
+                {
+                    memcpy(get_page(m, flen, TRUE)->data, buf, n);
+                    break;
+                }
+            if (n < want)
+            {
+                flen += n;
+                break;
+            }
+        }
+    }
     if (ferror(f))
     {
-        err_print("fread() failed (0x%x)", flen);
+        err_print("fread() failed (0x%lx)", flen);
         return -1;
     }
     if (!feof(f))
     {
-        err_print("too large memory footprint (0x%x)", flen);
+        err_print("too large memory footprint (0x%lx)", flen);
         return -1;
     }
     return 0;
 }
 
+/* copy an image of 'len' bytes to a fresh memory, all-zero pages stay
+   untouched (-1 if it doesn't fit) */
+int load_image(mem_t *m, const byte_t *buf, long_t len)
+{
+    long_t addr, i, n;
+
+    if (len < 0 || len > m->len)
+        return -1;
+    if (m->data)
+    {
+        memcpy(m->data, buf, len);
+        return 0;
+    }
+    for (addr = 0; addr < len; addr += n)
+    {
+        n = len - addr < PAGE_SIZE ? len - addr : PAGE_SIZE;
+        for (i = 0; i < n; i++)
+            if (buf[addr + i])
+            {
+                memcpy(get_page(m, addr, TRUE)->data, buf + addr, n);
+                break;
+            }
+    }
+    return 0;
+}
+
 /*
  * compute_alu: do ALU operations
  * args
@@ -291,7 +960,6 @@ long_t compute_alu(alu_t op, long_t argA, long_t argB)
  */
 cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
 {
-    val = compute_alu(op, argA, argB);
     bool_t zero = (val == 0);
     bool_t sign = ((int)val < 0);
     bool_t ovf = FALSE;
@@ -312,11 +980,31 @@ cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
     return PACK_CC(zero, sign, ovf);
 }
 
-/*
- * cond_doit: whether do (mov or jmp) it?
- * args
- *     PACK_CC: the current condition codes
- *     cond: conditions (C_YES, C_LE, C_L, C_E, C_NE, C_GE, C_G)
+/* get_cc: the current condition codes, derived from the last ALU op if needed */
+cc_t get_cc(y64sim_t *sim)
+{
+    if (sim->lcc.op >= 0)
+    {
+        sim->cc = compute_cc(sim->lcc.op, sim->lcc.valA, sim->lcc.valB, sim->lcc.val);
+        sim->lcc.op = -1;
+    }
+    return sim->cc;
+}
+
+/* set_cc_lazy: record an ALU op, its flags are worked out by get_cc() */
+void set_cc_lazy(y64sim_t *sim, alu_t op, long_t argA, long_t argB, long_t val)
+{
+    sim->lcc.op = op;
+    sim->lcc.valA = argA;
+    sim->lcc.valB = argB;
+    sim->lcc.val = val;
+}
+
+/*
+ * cond_doit: whether do (mov or jmp) it?
+ * args
+ *     PACK_CC: the current condition codes
+ *     cond: conditions (C_YES, C_LE, C_L, C_E, C_NE, C_GE, C_G)
  *
  * return
  *     TRUE: do it
@@ -353,255 +1041,2683 @@ bool_t cond_doit(cc_t cc, cond_t cond)
     return doit;
 }
 
+/* sim_cond: cond_doit() on the simulator's flags, skipping them for C_YES */
+bool_t sim_cond(y64sim_t *sim, cond_t cond)
+{
+    return cond == C_YES || cond_doit(get_cc(sim), cond);
+}
+
 /*
- * nexti: execute single instruction and return status.
+ * decode_inst: fetch and split up the instruction at 'pc'
  * args
- *     sim: the y64 image with PC, register and memory
+ *     m: the memory image
+ *     pc: address of the instruction
+ *     d: filled with icode, ifun, registers, immediate and length
  *
  * return
- *     STAT_AOK: continue
- *     STAT_HLT: halt
- *     STAT_ADR: invalid instruction address
- *     STAT_INS: invalid instruction, register id, data address, stack address, ...
+ *     TRUE: success
+ *     FALSE: the opcode or register byte is out of memory
  */
-stat_t nexti(y64sim_t *sim)
+bool_t decode_inst(mem_t *m, long_t pc, dinst_t *d)
 {
-    byte_t codefun = 0; /* 1 byte, indicates the kind of this instruction*/
-    itype_t icode;
-    alu_t ifun;
-    long_t next_pc = sim->pc;
-
-    regid_t regA, regB;
-    long_t valA, valB;
-    long_t imm;
-    long_t temp;
-
-    long_t nowrsp = get_reg_val(sim->r, REG_RSP);
+    byte_t codefun, regbyte;
+    long_t next_pc = pc;
 
-    /* get code and function （1 byte) */
-    if (!get_byte_val(sim->m, next_pc, &codefun))
-    {
-        err_print("PC = 0x%lx, Invalid instruction address", sim->pc);
-        return STAT_ADR;
-    }
-    icode = GET_ICODE(codefun); /* look up CSAPP p247 */
-    ifun = GET_FUN(codefun);
+    /* get code and function (1 byte) */
+    if (!get_byte_val(m, next_pc, &codefun))
+        return FALSE;
+    d->icode = GET_ICODE(codefun);
+    d->ifun = GET_FUN(codefun);
+    d->rA = REG_NONE;
+    d->rB = REG_NONE;
+    d->imm = 0;
     next_pc++;
 
-    /* get registers if needed (1 byte)
-       rrmovq irmovq rmmovq mrmovq OPq cmov pushq popq*/
-
-    if (icode == I_RRMOVQ || icode == I_IRMOVQ || icode == I_RMMOVQ || icode == I_MRMOVQ ||
-        icode == I_ALU || icode == I_PUSHQ || icode == I_POPQ)
+    switch (d->icode)
     {
-        byte_t regbyte;
-        if (!get_byte_val(sim->m, next_pc, &regbyte))
-        {
-            err_print("PC = 0x%lx, Invalid instruction address", sim->pc);
-            return STAT_ADR;
-        }
-        regA = GET_REGA(regbyte);
-        regB = GET_REGB(regbyte);
-        valA = get_reg_val(sim->r, regA);
-        valB = get_reg_val(sim->r, regB);
+    /* get registers if needed (1 byte) */
+    case I_RRMOVQ:
+    case I_IRMOVQ:
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_ALU:
+    case I_PUSHQ:
+    case I_POPQ:
+        if (!get_byte_val(m, next_pc, &regbyte))
+            return FALSE;
+        d->rA = GET_REGA(regbyte);
+        d->rB = GET_REGB(regbyte);
         next_pc++;
+        break;
+    default:
+        break;
     }
-    /* get immediate if needed (8 bytes) */
-    if (icode == I_IRMOVQ || icode == I_RMMOVQ || icode == I_MRMOVQ ||
-        icode == I_JMP || icode == I_CALL)
+
+    switch (d->icode)
     {
-        get_long_val(sim->m, next_pc, &imm);
+    /* get immediate if needed (8 bytes) */
+    case I_IRMOVQ:
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_JMP:
+    case I_CALL:
+        get_long_val(m, next_pc, &d->imm);
         next_pc += 8;
+        break;
+    default:
+        break;
     }
 
-    /* execute the instruction*/
-    switch (icode)
+    d->pc = pc;
+    d->len = next_pc - pc;
+    return TRUE;
+}
+
+/*
+ * fuse_inst: make 'd' a superinstruction if it and the instruction after
+ *     it are one of the fuse_t pairs; the second one then counts as code
+ */
+static void fuse_inst(mem_t *m, dinst_t *d)
+{
+    dinst_t n;
+    long_t pc = d->pc + d->len;
+
+    d->fuse = FUSE_NONE;
+    if (d->icode == I_IRMOVQ)
+        d->fuse = FUSE_ADDI;
+    else if (d->icode == I_MRMOVQ)
+        d->fuse = FUSE_LOADADD;
+    else if (d->icode == I_ALU && (d->ifun == A_SUB || d->ifun == A_AND))
+        d->fuse = FUSE_CMPJ;
+    if (d->fuse == FUSE_NONE)
+        return;
+
+    if (!decode_inst(m, pc, &n) ||
+        (d->fuse == FUSE_CMPJ ? n.icode != I_JMP || n.ifun > C_G
+                              : n.icode != I_ALU || n.ifun != A_ADD))
     {
-    case I_HALT: /* 0:0 */
-        return STAT_HLT;
-        break;
+        d->fuse = FUSE_NONE;
+        return;
+    }
+    d->ifun2 = n.ifun;
+    d->rA2 = n.rA;
+    d->rB2 = n.rB;
+    d->imm2 = n.imm;
+    d->len2 = n.len;
+    set_code_flags(m, pc, pc + n.len <= m->len ? n.len : m->len - pc, 1);
+}
 
-    case I_NOP: /* 1:0 */
-        sim->pc = next_pc;
-        break;
+/*
+ * fetch_inst: look up the decoded instruction at 'pc', decoding and
+ *     caching it on a miss
+ *
+ * return
+ *     the decoded instruction, NULL if 'pc' can't be fetched
+ */
+dinst_t *fetch_inst(mem_t *m, long_t pc)
+{
+    dinst_t *d;
 
-    case I_RRMOVQ: /* 2:x regA:regB */
-        if (cond_doit(sim->cc, ifun))
-        {
-            set_reg_val(sim->r, regB, valA);
-        }
-        sim->pc = next_pc;
-        break;
+    if (pc < 0 || pc >= m->len)
+        return NULL;
+    d = &m->dcache[DCACHE_IDX(pc)];
+    if (d->pc == pc)
+        return d;
 
-    case I_IRMOVQ: /* 3:0 F:regB imm */
-        set_reg_val(sim->r, regB, imm);
-        sim->pc = next_pc;
-        break;
+    if (!decode_inst(m, pc, d))
+    {
+        d->pc = -1;
+        return NULL;
+    }
+    d->prof = NULL;
+    set_code_flags(m, pc, pc + d->len <= m->len ? d->len : m->len - pc, 1);
+    fuse_inst(m, d);
+    return d;
+}
 
-    case I_RMMOVQ: /* 4:0 regA:regB imm */
-        if (!set_long_val(sim->m, valB + imm, valA))
-        {
-            err_print("PC = 0x%lx, Invalid data address 0x%lx", sim->pc, valB + imm);
-            return STAT_ADR;
-        }
-        sim->pc = next_pc;
-        break;
+/*
+ * Profiler
+ */
 
-    case I_MRMOVQ: /* 5:0 regB:regA imm */
-        // printf(">>>>>>>>>>>>>>>>>>  %s = %ld, ", reg_table[regB].name, valB);
-        // printf("imm = %ld\n", imm);
-        if (!get_long_val(sim->m, valB + imm, &temp))
-        {
-            err_print("PC = 0x%lx, Invalid data address 0x%lx", sim->pc, valB + imm);
-            return STAT_ADR;
-        }
-        set_reg_val(sim->r, regA, temp);
-        sim->pc = next_pc;
-        break;
+/*
+ * prof_find: find (or add) the entry of 'pc'
+ * args
+ *     m: memory whose decoded instructions point into 't', they are
+ *        dropped when the table grows (may be NULL)
+ */
+prof_ent_t *prof_find(prof_tab_t *t, long_t pc, mem_t *m)
+{
+    prof_ent_t *old = t->ents;
+    long_t i, cap = t->cap;
 
-    case I_ALU: /* 6:x regA:regB */
-        sim->cc = compute_cc(ifun, valA, valB, 0);
-        set_reg_val(sim->r, regB, compute_alu(ifun, valA, valB));
-        sim->pc = next_pc;
-        break;
+    if (2 * (t->n + 1) > t->cap)
+    {
+        t->cap = cap ? cap * 2 : 1024;
+        t->ents = (prof_ent_t *)malloc(t->cap * sizeof(prof_ent_t));
+        for (i = 0; i < t->cap; i++)
+            t->ents[i].pc = -1;
+        t->n = 0;
+        for (i = 0; i < cap; i++)
+            if (old[i].pc != -1)
+                *prof_find(t, old[i].pc, NULL) = old[i];
+        free((void *)old);
+        for (i = 0; m && i < DCACHE_SIZE; i++)
+            m->dcache[i].prof = NULL;
+    }
 
-    case I_JMP: /* 7:x imm */
-        // printf(">>>>>> PC = 0x%lx, targetAddr = 0x%lx, status: %s\n", sim->pc, imm, cc_names[sim->cc]);
-        if (cond_doit(sim->cc, ifun))
-        {
-            sim->pc = imm;
-        }
-        else
+    i = (pc * 0x9E3779B97F4A7C15UL) >> 20;
+    for (i &= t->cap - 1; t->ents[i].pc != pc; i = (i + 1) & (t->cap - 1))
+        if (t->ents[i].pc == -1)
         {
-            sim->pc = next_pc;
+            memset(&t->ents[i], 0, sizeof(prof_ent_t));
+            t->ents[i].pc = pc;
+            t->n++;
+            break;
         }
-        break;
+    return &t->ents[i];
+}
 
-    case I_CALL: /* 8:x imm */
-        // printf("PC = 0x%lx, rsp = 0x%lx, target = 0x%lx\n", sim->pc, nowrsp, imm);
-        set_reg_val(sim->r, REG_RSP, nowrsp - 8);
-        if (!set_long_val(sim->m, nowrsp - 8, next_pc))
-        {
-            err_print("PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp - 8);
-            return STAT_ADR;
-        }
-        sim->pc = imm;
-        break;
+/* count the instruction 'd' about to be executed */
+static inline void prof_inst(prof_t *p, mem_t *m, dinst_t *d)
+{
+    p->steps++;
+    p->ops[d->icode < I_DIRECTIVE ? d->icode : I_DIRECTIVE][d->ifun & 0xF]++;
+    if (!d->prof)
+        d->prof = prof_find(&p->pcs, d->pc, m);
+    d->prof->count++;
+}
 
-    case I_RET: /* 9:0 */
-        long_t retaddr;
-        if (!get_long_val(sim->m, nowrsp, &retaddr))
-        {
-            err_print("PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp);
-            return STAT_ADR;
-        }
-        set_reg_val(sim->r, REG_RSP, nowrsp + 8);
-        sim->pc = retaddr;
-        break;
+/* count a conditional jump at the PC of 'd' */
+static inline void prof_branch(prof_t *p, dinst_t *d, bool_t taken)
+{
+    d->prof->cond = TRUE;
+    if (taken)
+    {
+        p->taken++;
+        d->prof->taken++;
+    }
+    else
+        p->not_taken++;
+}
 
-    case I_PUSHQ: /* A:0 regA:F */
-        if (regB != REG_NONE)
-        {
-            // err_print("PC = 0x%lx, Invalid instruction 0x%lx", sim->pc, nowrsp - 8);
-            return STAT_INS; /* unsupported now, replace it with your implementation */
-        }
-        set_reg_val(sim->r, REG_RSP, nowrsp - 8);
-        if (!set_long_val(sim->m, nowrsp - 8, valA))
-        {
-            err_print("PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp - 8);
-            return STAT_ADR;
-        };
-        sim->pc = next_pc;
-        break;
+/* a call to 'target' (with the current instruction already counted) */
+void prof_call(prof_t *p, long_t target)
+{
+    prof_find(&p->calls, target, NULL)->count++;
+    if (p->depth < PROF_DEPTH)
+    {
+        p->stack[p->depth][0] = target;
+        p->stack[p->depth][1] = p->steps;
+    }
+    p->depth++;
+}
 
-    case I_POPQ: /* B:0 regA:F */
-        if (regB != REG_NONE)
-        {
-            return STAT_INS; /* unsupported now, replace it with your implementation */
-        }
-        set_reg_val(sim->r, REG_RSP, nowrsp + 8);
-        if (!get_long_val(sim->m, nowrsp, &temp))
-        {
-            err_print("PC = 0x%lx, Invalid stack address 0x%lx\n", sim->pc, nowrsp + 8);
-            return STAT_ADR;
-        }
-        set_reg_val(sim->r, regA, temp);
-        sim->pc = next_pc;
-        break;
+/* a return, charging the steps since the matching call to its target */
+void prof_ret(prof_t *p)
+{
+    if (p->depth == 0)
+        return;
+    if (--p->depth < PROF_DEPTH)
+        prof_find(&p->calls, p->stack[p->depth][0], NULL)->steps +=
+            p->steps - p->stack[p->depth][1];
+}
 
-    default:
-        err_print("PC = 0x%lx, Invalid instruction %.2x", sim->pc, codefun);
-        return STAT_INS;
-    }
+static char *inst_name(int icode, int ifun, char *buf)
+{
+    static char *cond[] = {"", "le", "l", "e", "ne", "ge", "g"};
+    static char *alu[] = {"addq", "subq", "andq", "xorq"};
+    static char *plain[] = {"halt", "nop", NULL, "irmovq", "rmmovq", "mrmovq",
+                            NULL, NULL, "call", "ret", "pushq", "popq"};
+
+    if (icode == I_RRMOVQ && ifun <= C_G)
+        sprintf(buf, ifun == C_YES ? "rrmovq" : "cmov%s", cond[ifun]);
+    else if (icode == I_JMP && ifun <= C_G)
+        sprintf(buf, "j%s", ifun == C_YES ? "mp" : cond[ifun]);
+    else if (icode == I_ALU && ifun < A_NONE)
+        strcpy(buf, alu[ifun]);
+    else if (icode < I_DIRECTIVE && plain[icode] && ifun == F_NONE)
+        strcpy(buf, plain[icode]);
+    else
+        sprintf(buf, "bad %x:%x", icode, ifun);
+    return buf;
+}
 
-    return STAT_AOK;
+static int cmp_count(const void *a, const void *b)
+{
+    long_t x = ((prof_ent_t *)a)->count, y = ((prof_ent_t *)b)->count;
+    if (x != y)
+        return x < y ? 1 : -1;
+    return ((prof_ent_t *)a)->pc < ((prof_ent_t *)b)->pc ? -1 : 1;
 }
 
-void usage(char *pname)
+static int cmp_steps(const void *a, const void *b)
 {
-    printf("Usage: %s file.bin [max_steps]\n", pname);
-    exit(0);
+    long_t x = ((prof_ent_t *)a)->steps, y = ((prof_ent_t *)b)->steps;
+    if (x != y)
+        return x < y ? 1 : -1;
+    return cmp_count(a, b);
 }
 
-int main(int argc, char *argv[])
+/* pack the used entries of 't' to its front, sorted by 'cmp' */
+static long_t prof_sort(prof_tab_t *t, int (*cmp)(const void *, const void *))
 {
-    FILE *binfile;
-    int max_steps = MAX_STEP;
-    y64sim_t *sim;
-    mem_t *saver, *savem;
-    int step = 0;
-    stat_t e = STAT_AOK;
+    long_t i, n = 0;
 
-    if (argc < 2 || argc > 3)
-        usage(argv[0]);
+    for (i = 0; i < t->cap; i++)
+        if (t->ents[i].pc != -1)
+            t->ents[n++] = t->ents[i];
+    qsort(t->ents, n, sizeof(prof_ent_t), cmp);
+    return n;
+}
 
-    /* set max steps */
-    if (argc > 2)
-        max_steps = atoi(argv[2]);
+#define PCT(a, b) ((b) ? 100.0 * (a) / (b) : 0.0)
 
-    /* load binary file to memory */
-    if (strcmp(argv[1] + (strlen(argv[1]) - 4), ".bin"))
-        usage(argv[0]); /* only support *.bin file */
+/*
+ * print_prof: print the instruction mix, the hottest PCs (disassembled from
+ *     'm') and call targets; the tables are sorted in place, so the
+ *     profile is finished after it
+ */
+void print_prof(prof_t *p, mem_t *m, FILE *out)
+{
+    prof_ent_t mix[(I_DIRECTIVE + 1) * 16];
+    prof_ent_t *e;
+    dinst_t d;
+    char name[16];
+    long_t i, n;
+
+    fprintf(out, "\nProfile: %ld instructions\n", p->steps);
+    fprintf(out, "Instruction mix:\n");
+    for (i = n = 0; i < (I_DIRECTIVE + 1) * 16; i++)
+        if (p->ops[i / 16][i % 16])
+        {
+            mix[n].pc = i;
+            mix[n++].count = p->ops[i / 16][i % 16];
+        }
+    qsort(mix, n, sizeof(prof_ent_t), cmp_count);
+    for (i = 0; i < n; i++)
+        fprintf(out, "    %-8s %12ld %6.2f%%\n", inst_name(mix[i].pc / 16, mix[i].pc % 16, name),
+                mix[i].count, PCT(mix[i].count, p->steps));
 
-    binfile = fopen(argv[1], "rb");
-    if (!binfile)
+    fprintf(out, "Conditional jumps: %ld taken, %ld not taken (%.2f%% taken)\n",
+            p->taken, p->not_taken, PCT(p->taken, p->taken + p->not_taken));
+
+    fprintf(out, "Hot spots:\n");
+    n = p->pcs.cap ? prof_sort(&p->pcs, cmp_count) : 0;
+    for (i = 0; i < n && i < PROF_TOP; i++)
     {
-        err_print("Can't open binary file '%s'", argv[1]);
-        exit(1);
+        e = &p->pcs.ents[i];
+        if (!decode_inst(m, e->pc, &d))
+            d.icode = I_DIRECTIVE;
+        fprintf(out, "    0x%.16lx %12ld %6.2f%%  %s", e->pc, e->count, PCT(e->count, p->steps),
+                inst_name(d.icode, d.ifun, name));
+        if (e->cond)
+            fprintf(out, "  taken %ld", e->taken);
+        fprintf(out, "\n");
     }
 
-    sim = new_y64sim(MEM_SIZE);
-    if (load_binfile(sim->m, binfile) < 0)
+    fprintf(out, "Call targets:\n");
+    n = p->calls.cap ? prof_sort(&p->calls, cmp_steps) : 0;
+    for (i = 0; i < n && i < PROF_TOP; i++)
     {
-        err_print("Failed to load binary file '%s'", argv[1]);
-        free_y64sim(sim);
-        exit(1);
+        e = &p->calls.ents[i];
+        fprintf(out, "    0x%.16lx %12ld calls %12ld steps %6.2f%%\n",
+                e->pc, e->count, e->steps, PCT(e->steps, p->steps));
     }
-    fclose(binfile);
+}
 
-    /* save initial register and memory stat */
-    saver = dup_reg(sim->r);
-    savem = dup_mem(sim->m);
+/*
+ * PIPE timing model
+ */
 
-    /* execute binary code step-by-step */
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-        e = nexti(sim);
+/*
+ * pipe_inst: account the instruction 'd' about to be executed by 'sim'
+ *     (which must not have changed yet for a jump to be judged right)
+ */
+void pipe_inst(y64sim_t *sim, dinst_t *d)
+{
+    pipe_t *p = sim->pipe;
+    regid_t srcA = REG_NONE, srcB = REG_NONE;
 
-    /* print final stat of y64sim */
-    printf("Stopped in %d steps at PC = 0x%lx.  Status '%s', CC %s\n",
-           step, sim->pc, stat_name(e), cc_name(sim->cc));
+    switch (d->icode)
+    {
+    case I_RRMOVQ:
+    case I_RMMOVQ:
+    case I_ALU:
+    case I_PUSHQ:
+        srcA = d->rA;
+        break;
+    case I_POPQ:
+    case I_RET:
+        srcA = REG_RSP;
+        break;
+    default:
+        break;
+    }
+    switch (d->icode)
+    {
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_ALU:
+        srcB = d->rB;
+        break;
+    case I_PUSHQ:
+    case I_POPQ:
+    case I_CALL:
+    case I_RET:
+        srcB = REG_RSP;
+        break;
+    default:
+        break;
+    }
+
+    p->insts++;
+    /* a loaded value can't be forwarded to decode in time: one bubble */
+    if (p->load_dst != REG_NONE && (p->load_dst == srcA || p->load_dst == srcB))
+        p->load_use++;
+    p->load_dst = d->icode == I_MRMOVQ || d->icode == I_POPQ ? d->rA : REG_NONE;
+
+    /* fetch went on at the target, cancel two instructions if not taken */
+    if (d->icode == I_JMP && d->ifun != C_YES && !sim_cond(sim, d->ifun))
+        p->mispredict++;
+    /* fetch waits for the return address to come out of memory */
+    if (d->icode == I_RET)
+        p->ret++;
+}
 
-    printf("Changes to registers:\n");
-    diff_reg(saver, sim->r, stdout);
+void print_pipe(pipe_t *p, FILE *out)
+{
+    long_t bubbles = p->load_use * LOAD_USE_BUBBLES + p->mispredict * MISPREDICT_BUBBLES +
+                     p->ret * RET_BUBBLES;
+    long_t cycles = p->insts ? p->insts + PIPE_FILL + bubbles : 0;
+
+    fprintf(out, "\nPipeline: %ld instructions, %ld cycles, CPI %.2f\n",
+            p->insts, cycles, p->insts ? (double)cycles / p->insts : 0.0);
+    fprintf(out, "    load/use      %10ld stalls   %10ld bubbles\n",
+            p->load_use, p->load_use * LOAD_USE_BUBBLES);
+    fprintf(out, "    mispredicted  %10ld jumps    %10ld bubbles\n",
+            p->mispredict, p->mispredict * MISPREDICT_BUBBLES);
+    fprintf(out, "    ret           %10ld returns  %10ld bubbles\n",
+            p->ret, p->ret * RET_BUBBLES);
+}
 
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, sim->m, stdout);
+/* run the predictors on the instruction 'd' about to be executed by 'sim' */
+void bp_inst(y64sim_t *sim, dinst_t *d)
+{
+    bpsim_t *b = sim->bp;
+    bpred_t *bp;
+    bool_t taken;
+    long_t ret;
 
-    free_y64sim(sim);
-    free_reg(saver);
-    free_mem(savem);
+    switch (d->icode)
+    {
+    case I_JMP:
+        if (d->ifun == C_YES)
+            break;
+        taken = sim_cond(sim, d->ifun);
+        b->jumps++;
+        for (bp = b->preds; bp < b->preds + NUM_BPRED; bp++)
+        {
+            if (bp->predict(bp, d->pc, d->imm) != taken)
+                bp->misses++;
+            if (bp->update)
+                bp->update(bp, d->pc, taken);
+        }
+        break;
+    case I_CALL:
+        b->ras_top = (b->ras_top + 1) % RAS_DEPTH;
+        b->ras[b->ras_top] = d->pc + d->len;
+        if (b->ras_n < RAS_DEPTH)
+            b->ras_n++;
+        break;
+    case I_RET:
+        if (!get_long_val(sim->m, get_reg_val(sim->regs, REG_RSP), &ret))
+            break;
+        b->rets++;
+        if (b->ras_n == 0 || b->ras[b->ras_top] != ret)
+            b->ras_misses++;
+        if (b->ras_n > 0)
+        {
+            b->ras_top = (b->ras_top + RAS_DEPTH - 1) % RAS_DEPTH;
+            b->ras_n--;
+        }
+        break;
+    default:
+        break;
+    }
+}
 
-    return 0;
+/* misses and their cost in the PIPE pipeline (see pipe_inst) */
+void print_bpsim(bpsim_t *b, FILE *out)
+{
+    bpred_t *bp;
+
+    fprintf(out, "\nBranch predictors: %ld conditional jumps, %ld returns\n",
+            b->jumps, b->rets);
+    for (bp = b->preds; bp < b->preds + NUM_BPRED; bp++)
+        fprintf(out, "    %-13s misses %10ld %6.2f%%  penalty %10ld cycles\n", bp->name,
+                bp->misses, PCT(bp->misses, b->jumps), bp->misses * MISPREDICT_BUBBLES);
+    fprintf(out, "    %-13s misses %10ld %6.2f%%  penalty %10ld cycles\n", "ras",
+            b->ras_misses, PCT(b->ras_misses, b->rets), b->ras_misses * RET_BUBBLES);
 }
 
-;
+/* access the block holding 'addr', a miss goes on to the next level */
+static void cache_access(cache_t *c, long_t addr)
+{
+    unsigned long set = ((unsigned long)addr >> c->b) & ((1UL << c->s) - 1);
+    long_t tag = (unsigned long)addr >> (c->s + c->b);
+    cline_t *line = c->lines + set * c->E;
+    cline_t *victim = line;
+    int i;
+
+    c->clock++;
+    for (i = 0; i < c->E; i++)
+    {
+        if (line[i].valid && line[i].tag == tag)
+        {
+            c->hits++;
+            line[i].lru = c->clock;
+            return;
+        }
+        if (!line[i].valid || (victim->valid && line[i].lru < victim->lru))
+            victim = &line[i];
+    }
+
+    c->misses++;
+    if (victim->valid)
+        c->evictions++;
+    victim->valid = TRUE;
+    victim->tag = tag;
+    victim->lru = c->clock;
+    if (c->next)
+        cache_access(c->next, addr);
+}
+
+/* access every block of [addr, addr+len) in memory 'm' (none if it faults) */
+static void cache_range(cache_t *c, mem_t *m, long_t addr, int len)
+{
+    long_t blk;
+
+    if (!IN_MEM(m, addr, len))
+        return;
+    for (blk = addr >> c->b; blk <= (addr + len - 1) >> c->b; blk++)
+        cache_access(c, blk << c->b);
+}
+
+/*
+ * data_access: the data access of the instruction 'd' about to be executed
+ *     (all of them are 8 bytes)
+ * return
+ *     'L' (load), 'S' (store), or 0 if it has none or it would fault
+ */
+static char data_access(y64sim_t *sim, dinst_t *d, long_t *addr)
+{
+    long_t rsp = get_reg_val(sim->regs, REG_RSP);
+    char kind;
+
+    switch (d->icode)
+    {
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+        *addr = get_reg_val(sim->regs, d->rB) + d->imm;
+        kind = d->icode == I_RMMOVQ ? 'S' : 'L';
+        break;
+    case I_PUSHQ:
+    case I_CALL:
+        *addr = rsp - 8;
+        kind = d->icode == I_CALL || d->rB == REG_NONE ? 'S' : 0;
+        break;
+    case I_POPQ:
+    case I_RET:
+        *addr = rsp;
+        kind = d->icode == I_RET || d->rB == REG_NONE ? 'L' : 0;
+        break;
+    default:
+        return 0;
+    }
+    return IN_MEM(sim->m, *addr, 8) ? kind : 0;
+}
+
+/* report the load or store of the instruction 'd' to the library callback */
+void mem_inst(y64sim_t *sim, dinst_t *d)
+{
+    long_t addr;
+    char kind;
+
+    if ((kind = data_access(sim, d, &addr)) != 0)
+        sim->mem_cb(sim->mem_arg, d->pc, kind, addr, 8);
+}
+
+/* count the edge from the previous instruction to 'd' (saturating) */
+void cov_inst(y64sim_t *sim, dinst_t *d)
+{
+    byte_t *c = &sim->cov[(d->pc ^ sim->cov_prev) & sim->cov_mask];
+
+    if (*c != 0xFF)
+        (*c)++;
+    sim->cov_prev = d->pc >> 1;
+}
+
+/* the fetch, load and store of the instruction 'd' about to be executed
+   (the load or store only at the block holding its address, see cache_t) */
+void cache_inst(y64sim_t *sim, dinst_t *d)
+{
+    long_t addr;
+
+    cache_range(&sim->caches[C_L1I], sim->m, d->pc, d->len);
+    if (data_access(sim, d, &addr))
+        cache_access(&sim->caches[C_L1D], addr);
+}
+
+/*
+ * Memory trace
+ */
+
+/* open 'fname' for a trace (with I lines if 'fetches'), NULL on error */
+trace_t *open_trace(char *fname, bool_t fetches)
+{
+    trace_t *t;
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        err_print("Can't open trace file '%s'", fname);
+        return NULL;
+    }
+    t = (trace_t *)malloc(sizeof(trace_t));
+    t->fd = fd;
+    t->fetches = fetches;
+    t->failed = FALSE;
+    t->used = 0;
+    return t;
+}
+
+static void flush_trace(trace_t *t)
+{
+    int pos, n;
+
+    for (pos = 0; !t->failed && pos < t->used; pos += n)
+        if ((n = write(t->fd, t->buf + pos, t->used - pos)) <= 0)
+            t->failed = TRUE;
+    t->used = 0;
+}
+
+/* flush and close the trace, return -1 if any of it couldn't be written */
+int close_trace(trace_t *t)
+{
+    int ret;
+
+    flush_trace(t);
+    ret = t->failed || close(t->fd) < 0 ? -1 : 0;
+    free((void *)t);
+    return ret;
+}
+
+/* append "I  addr,size", " L addr,size" or " S addr,size" */
+static void trace_line(trace_t *t, char kind, long_t addr, int size)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned long a = addr;
+    char *p;
+    int n;
+
+    if (t->used > TRACE_BUF_SIZE - TRACE_LINE_MAX)
+        flush_trace(t);
+    p = t->buf + t->used;
+    *p++ = kind == 'I' ? 'I' : ' ';
+    *p++ = kind == 'I' ? ' ' : kind;
+    *p++ = ' ';
+    /* like lackey's %08lx */
+    for (n = 8; n < 16 && a >> 4 * n; n++)
+        ;
+    while (n-- > 0)
+        *p++ = hex[a >> 4 * n & 0xF];
+    *p++ = ',';
+    if (size >= 10)
+        *p++ = '0' + size / 10;
+    *p++ = '0' + size % 10;
+    *p++ = '\n';
+    t->used = p - t->buf;
+}
+
+/* trace the fetch, load and store of the instruction 'd' about to be executed */
+void trace_inst(y64sim_t *sim, dinst_t *d)
+{
+    long_t addr;
+    char kind;
+
+    if (sim->trace->fetches)
+        trace_line(sim->trace, 'I', d->pc, d->len);
+    if ((kind = data_access(sim, d, &addr)) != 0)
+        trace_line(sim->trace, kind, addr, 8);
+}
+
+/*
+ * Undo log
+ */
+
+/* record what the instruction 'd' at the PC may overwrite (d is NULL if
+   it couldn't be fetched, that step changes nothing) */
+void undo_record(y64sim_t *sim, dinst_t *d)
+{
+    undo_t *u = sim->undo;
+    undo_rec_t *r = &u->recs[u->head];
+    int i;
+
+    r->pc = sim->pc;
+    r->cc = get_cc(sim);
+    r->reg[0] = r->reg[1] = REG_NONE;
+    r->addr = -1;
+    switch (d ? d->icode : I_HALT)
+    {
+    case I_RRMOVQ:
+    case I_IRMOVQ:
+    case I_ALU:
+        r->reg[0] = d->rB;
+        break;
+    case I_MRMOVQ:
+        r->reg[0] = d->rA;
+        break;
+    case I_POPQ:
+        r->reg[1] = d->rA;
+        /* fall through */
+    case I_PUSHQ:
+    case I_CALL:
+    case I_RET:
+        r->reg[0] = REG_RSP;
+        break;
+    default:
+        break;
+    }
+    for (i = 0; i < 2; i++)
+        r->rval[i] = get_reg_val(sim->regs, r->reg[i]);
+    if (d && data_access(sim, d, &r->addr) != 'S')
+        r->addr = -1;
+    else if (d)
+        get_long_val(sim->m, r->addr, &r->old);
+
+    u->head = (u->head + 1) % u->cap;
+    if (u->n < u->cap)
+        u->n++;
+}
+
+/* take back the last recorded step, FALSE if there is none */
+bool_t undo_step(y64sim_t *sim)
+{
+    undo_t *u = sim->undo;
+    undo_rec_t *r;
+
+    if (u->n == 0)
+        return FALSE;
+    u->head = (u->head + u->cap - 1) % u->cap;
+    u->n--;
+    r = &u->recs[u->head];
+    if (r->addr != -1)
+        set_long_val(sim->m, r->addr, r->old);
+    /* popq %rsp: the popped value wins, so restore in reverse */
+    set_reg_val(sim->regs, r->reg[1], r->rval[1]);
+    set_reg_val(sim->regs, r->reg[0], r->rval[0]);
+    sim->pc = r->pc;
+    sim->cc = r->cc;
+    sim->lcc.op = -1;
+    return TRUE;
+}
+
+/*
+ * undo_find_write: find the last recorded step storing to 'addr'
+ * return
+ *     how many steps back it is (1: the last one), -1 if not recorded
+ */
+long_t undo_find_write(undo_t *u, long_t addr)
+{
+    undo_rec_t *r;
+    long_t k;
+
+    for (k = 1; k <= u->n; k++)
+    {
+        r = &u->recs[(u->head + u->cap - k) % u->cap];
+        if (r->addr != -1 && addr >= r->addr && addr < r->addr + 8)
+            return k;
+    }
+    return -1;
+}
+
+void print_caches(cache_t *c, FILE *out)
+{
+    static char *names[] = {"L1I", "L1D", "L2"};
+    int i;
+
+    fprintf(out, "\nCaches:\n");
+    for (i = 0; i < NUM_CACHE; i++)
+        fprintf(out, "    %-3s (s=%d, E=%d, b=%d)  hits:%ld misses:%ld evictions:%ld\n",
+                names[i], c[i].s, c[i].E, c[i].b, c[i].hits, c[i].misses, c[i].evictions);
+}
+
+/*
+ * exec_inst: execute the instruction 'd' fetched from the PC (see nexti)
+ */
+stat_t exec_inst(y64sim_t *sim, dinst_t *d)
+{
+    byte_t codefun = 0; /* 1 byte, indicates the kind of this instruction*/
+    itype_t icode;
+    alu_t ifun;
+    long_t next_pc;
+
+    regid_t regA, regB;
+    long_t valA, valB;
+    long_t imm;
+    long_t temp;
+
+    long_t nowrsp = get_reg_val(sim->regs, REG_RSP);
+
+    if (sim->prof)
+        prof_inst(sim->prof, sim->m, d);
+    if (sim->pipe)
+        pipe_inst(sim, d);
+    if (sim->bp)
+        bp_inst(sim, d);
+    if (sim->caches)
+        cache_inst(sim, d);
+    if (sim->trace)
+        trace_inst(sim, d);
+    if (sim->undo)
+        undo_record(sim, d);
+    if (sim->mem_cb)
+        mem_inst(sim, d);
+    if (sim->cov)
+        cov_inst(sim, d);
+    icode = d->icode;
+    ifun = d->ifun;
+    codefun = HPACK(icode, ifun);
+    regA = d->rA;
+    regB = d->rB;
+    imm = d->imm;
+    next_pc = sim->pc + d->len;
+
+    /* rrmovq irmovq rmmovq mrmovq OPq cmov pushq popq read registers,
+       REG_NONE reads as 0 for the rest */
+    valA = get_reg_val(sim->regs, regA);
+    valB = get_reg_val(sim->regs, regB);
+
+    /* execute the instruction*/
+    switch (icode)
+    {
+    case I_HALT: /* 0:0 */
+        return STAT_HLT;
+        break;
+
+    case I_NOP: /* 1:0 */
+        sim->pc = next_pc;
+        break;
+
+    case I_RRMOVQ: /* 2:x regA:regB */
+        if (sim_cond(sim, ifun))
+        {
+            set_reg_val(sim->regs, regB, valA);
+        }
+        sim->pc = next_pc;
+        break;
+
+    case I_IRMOVQ: /* 3:0 F:regB imm */
+        set_reg_val(sim->regs, regB, imm);
+        sim->pc = next_pc;
+        break;
+
+    case I_RMMOVQ: /* 4:0 regA:regB imm */
+        if (!set_long_val(sim->m, valB + imm, valA))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid data address 0x%lx", sim->pc, valB + imm);
+            return STAT_ADR;
+        }
+        sim->pc = next_pc;
+        break;
+
+    case I_MRMOVQ: /* 5:0 regB:regA imm */
+        // printf(">>>>>>>>>>>>>>>>>>  %s = %ld, ", reg_table[regB].name, valB);
+        // printf("imm = %ld\n", imm);
+        if (!get_long_val(sim->m, valB + imm, &temp))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid data address 0x%lx", sim->pc, valB + imm);
+            return STAT_ADR;
+        }
+        set_reg_val(sim->regs, regA, temp);
+        sim->pc = next_pc;
+        break;
+
+    case I_ALU: /* 6:x regA:regB */
+        temp = compute_alu(ifun, valA, valB);
+        set_cc_lazy(sim, ifun, valA, valB, temp);
+        set_reg_val(sim->regs, regB, temp);
+        sim->pc = next_pc;
+        break;
+
+    case I_JMP: /* 7:x imm */
+        // printf(">>>>>> PC = 0x%lx, targetAddr = 0x%lx, status: %s\n", sim->pc, imm, cc_names[sim->cc]);
+        if (sim_cond(sim, ifun))
+        {
+            sim->pc = imm;
+            if (sim->prof && d->ifun != C_YES)
+                prof_branch(sim->prof, d, TRUE);
+        }
+        else
+        {
+            sim->pc = next_pc;
+            if (sim->prof)
+                prof_branch(sim->prof, d, FALSE);
+        }
+        break;
+
+    case I_CALL: /* 8:x imm */
+        // printf("PC = 0x%lx, rsp = 0x%lx, target = 0x%lx\n", sim->pc, nowrsp, imm);
+        set_reg_val(sim->regs, REG_RSP, nowrsp - 8);
+        if (!set_long_val(sim->m, nowrsp - 8, next_pc))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp - 8);
+            return STAT_ADR;
+        }
+        sim->pc = imm;
+        if (sim->prof)
+            prof_call(sim->prof, imm);
+        break;
+
+    case I_RET: /* 9:0 */
+        long_t retaddr;
+        if (!get_long_val(sim->m, nowrsp, &retaddr))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp);
+            return STAT_ADR;
+        }
+        set_reg_val(sim->regs, REG_RSP, nowrsp + 8);
+        sim->pc = retaddr;
+        if (sim->prof)
+            prof_ret(sim->prof);
+        break;
+
+    case I_PUSHQ: /* A:0 regA:F */
+        if (regB != REG_NONE)
+        {
+            // err_print("PC = 0x%lx, Invalid instruction 0x%lx", sim->pc, nowrsp - 8);
+            return STAT_INS; /* unsupported now, replace it with your implementation */
+        }
+        set_reg_val(sim->regs, REG_RSP, nowrsp - 8);
+        if (!set_long_val(sim->m, nowrsp - 8, valA))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx", sim->pc, nowrsp - 8);
+            return STAT_ADR;
+        };
+        sim->pc = next_pc;
+        break;
+
+    case I_POPQ: /* B:0 regA:F */
+        if (regB != REG_NONE)
+        {
+            return STAT_INS; /* unsupported now, replace it with your implementation */
+        }
+        set_reg_val(sim->regs, REG_RSP, nowrsp + 8);
+        if (!get_long_val(sim->m, nowrsp, &temp))
+        {
+            sim_err_print(sim, "PC = 0x%lx, Invalid stack address 0x%lx\n", sim->pc, nowrsp + 8);
+            return STAT_ADR;
+        }
+        set_reg_val(sim->regs, regA, temp);
+        sim->pc = next_pc;
+        break;
+
+    default:
+        sim_err_print(sim, "PC = 0x%lx, Invalid instruction %.2x", sim->pc, codefun);
+        return STAT_INS;
+    }
+
+    return STAT_AOK;
+}
+
+/*
+ * nexti: execute single instruction and return status.
+ * args
+ *     sim: the y64 image with PC, register and memory
+ *
+ * return
+ *     STAT_AOK: continue
+ *     STAT_HLT: halt
+ *     STAT_ADR: invalid instruction address
+ *     STAT_INS: invalid instruction, register id, data address, stack address, ...
+ */
+stat_t nexti(y64sim_t *sim)
+{
+    /* get the decoded instruction (look up CSAPP p247) */
+    dinst_t *d = fetch_inst(sim->m, sim->pc);
+    if (!d)
+    {
+        if (sim->undo)
+            undo_record(sim, NULL);
+        sim_err_print(sim, "PC = 0x%lx, Invalid instruction address", sim->pc);
+        return STAT_ADR;
+    }
+    return exec_inst(sim, d);
+}
+
+/*
+ * translate_block: translate the basic block at 'pc' into threaded code
+ * args
+ *     m: the memory image
+ *     pc: entry of the block
+ *     tb: the block to fill
+ *     optab: handler labels indexed by icode, optab[I_DIRECTIVE] for
+ *            anything nexti() has to handle, optab[I_DIRECTIVE + 1] to exit
+ *
+ * the block ends after a control transfer (halt, jXX, call, ret) or an
+ * invalid instruction, or before an instruction that can't be fetched
+ */
+void translate_block(mem_t *m, long_t pc, tblock_t *tb, void **optab)
+{
+    dinst_t *d;
+    tinst_t *t;
+    bool_t end = FALSE;
+
+    tb->pc = pc;
+    for (tb->n = 0; !end && tb->n < TB_MAXLEN; tb->n++)
+    {
+        d = fetch_inst(m, pc);
+        if (!d)
+            break;
+        t = &tb->code[tb->n];
+        t->op = optab[d->icode < I_DIRECTIVE ? d->icode : I_DIRECTIVE];
+        t->ifun = d->ifun;
+        t->rA = d->rA;
+        t->rB = d->rB;
+        t->imm = d->imm;
+        t->next_pc = pc + d->len;
+        pc = t->next_pc;
+
+        if (d->icode == I_HALT || d->icode == I_JMP || d->icode == I_CALL ||
+            d->icode == I_RET || d->icode >= I_DIRECTIVE)
+            end = TRUE;
+    }
+    tb->code[tb->n].op = optab[I_DIRECTIVE + 1];
+}
+
+/* drop all translated blocks (the code they were built from changed) */
+void flush_tcache(y64sim_t *sim)
+{
+    int i;
+    for (i = 0; i < TB_CACHE_SIZE; i++)
+        sim->tcache[i].pc = -1;
+}
+
+/*
+ * run_threaded: execute up to 'max_steps' instructions with direct-threaded
+ *     code, staying inside translated blocks until a halt, a fault or the
+ *     step budget stops it. Anything that would fault (or a block that
+ *     doesn't fit the remaining budget) goes through nexti(), so the result
+ *     is the same as calling nexti() step-by-step.
+ * args
+ *     sim: the y64 image with PC, register and memory
+ *     max_steps: the step budget
+ *     steps: store the number of executed instructions
+ *
+ * return
+ *     the status of the last executed instruction (see nexti)
+ */
+stat_t run_threaded(y64sim_t *sim, long_t max_steps, long_t *steps)
+{
+    static void *optab[] = {
+        &&op_halt, &&op_nop, &&op_rrmovq, &&op_irmovq, &&op_rmmovq,
+        &&op_mrmovq, &&op_alu, &&op_jmp, &&op_call, &&op_ret,
+        &&op_pushq, &&op_popq, &&op_nexti, &&op_exit};
+    tblock_t *tb;
+    tinst_t *t;
+    long_t step = 0;
+    int gen = sim->tc_gen;
+    stat_t e = STAT_AOK;
+    long_t valA, valB, rsp, temp;
+
+#define NEXT        \
+    do              \
+    {               \
+        step++;     \
+        t++;        \
+        goto *t->op; \
+    } while (0)
+
+    if (!sim->tcache)
+    {
+        sim->tcache = (tblock_t *)malloc(TB_CACHE_SIZE * sizeof(tblock_t));
+        flush_tcache(sim);
+    }
+
+dispatch:
+    if (gen != sim->m->code_gen)
+    {
+        flush_tcache(sim);
+        gen = sim->tc_gen = sim->m->code_gen;
+    }
+    if (step >= max_steps)
+        goto done;
+    tb = &sim->tcache[TB_IDX(sim->pc)];
+    /* pc -1 is also what marks an empty slot */
+    if (tb->pc != sim->pc || sim->pc < 0)
+        translate_block(sim->m, sim->pc, tb, optab);
+    t = tb->code;
+    if (tb->n == 0 || tb->n > max_steps - step)
+        goto op_nexti;
+    goto *t->op;
+
+op_halt:
+    step++;
+    e = STAT_HLT;
+    goto done;
+
+op_nop:
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_rrmovq:
+    if (sim_cond(sim, t->ifun))
+        set_reg_val(sim->regs, t->rB, get_reg_val(sim->regs, t->rA));
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_irmovq:
+    set_reg_val(sim->regs, t->rB, t->imm);
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_rmmovq:
+    if (!set_long_val(sim->m, get_reg_val(sim->regs, t->rB) + t->imm,
+                      get_reg_val(sim->regs, t->rA)))
+        goto op_nexti;
+    sim->pc = t->next_pc;
+    if (gen != sim->m->code_gen)
+    {
+        step++;
+        goto dispatch;
+    }
+    NEXT;
+
+op_mrmovq:
+    if (!get_long_val(sim->m, get_reg_val(sim->regs, t->rB) + t->imm, &temp))
+        goto op_nexti;
+    set_reg_val(sim->regs, t->rA, temp);
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_alu:
+    valA = get_reg_val(sim->regs, t->rA);
+    valB = get_reg_val(sim->regs, t->rB);
+    temp = compute_alu(t->ifun, valA, valB);
+    set_cc_lazy(sim, t->ifun, valA, valB, temp);
+    set_reg_val(sim->regs, t->rB, temp);
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_jmp:
+    sim->pc = sim_cond(sim, t->ifun) ? t->imm : t->next_pc;
+    step++;
+    goto dispatch;
+
+op_call:
+    rsp = get_reg_val(sim->regs, REG_RSP);
+    if (!set_long_val(sim->m, rsp - 8, t->next_pc))
+        goto op_nexti;
+    set_reg_val(sim->regs, REG_RSP, rsp - 8);
+    sim->pc = t->imm;
+    step++;
+    goto dispatch;
+
+op_ret:
+    rsp = get_reg_val(sim->regs, REG_RSP);
+    if (!get_long_val(sim->m, rsp, &temp))
+        goto op_nexti;
+    set_reg_val(sim->regs, REG_RSP, rsp + 8);
+    sim->pc = temp;
+    step++;
+    goto dispatch;
+
+op_pushq:
+    rsp = get_reg_val(sim->regs, REG_RSP);
+    if (t->rB != REG_NONE ||
+        !set_long_val(sim->m, rsp - 8, get_reg_val(sim->regs, t->rA)))
+        goto op_nexti;
+    set_reg_val(sim->regs, REG_RSP, rsp - 8);
+    sim->pc = t->next_pc;
+    if (gen != sim->m->code_gen)
+    {
+        step++;
+        goto dispatch;
+    }
+    NEXT;
+
+op_popq:
+    rsp = get_reg_val(sim->regs, REG_RSP);
+    if (t->rB != REG_NONE || !get_long_val(sim->m, rsp, &temp))
+        goto op_nexti;
+    set_reg_val(sim->regs, REG_RSP, rsp + 8);
+    set_reg_val(sim->regs, t->rA, temp);
+    sim->pc = t->next_pc;
+    NEXT;
+
+op_nexti:
+    /* let the reference interpreter run (and report) this instruction */
+    e = nexti(sim);
+    step++;
+    if (e != STAT_AOK)
+        goto done;
+    goto dispatch;
+
+op_exit:
+    goto dispatch;
+
+done:
+    *steps = step;
+    return e;
+#undef NEXT
+}
+
+/*
+ * JIT for hot basic blocks (x86-64 hosts only)
+ *
+ * Native code keeps %rbx = register file, %r12 = memory, %r14 = codemap,
+ * %r13 = lazy_cc_t and %r15 = dirty bitmap. Loads and stores are
+ * bounds-checked against mem_t.len and stores that hit cached code or (if
+ * writes are tracked) blocks that aren't dirty yet leave the block, as do
+ * faults: the native code returns how many instructions it completed and the
+ * runner hands the offending one to nexti(), so results match the
+ * interpreter (and set_long_val() saves clean blocks before their first
+ * write).
+ */
+
+/* instructions the JIT compiles, everything else ends a block */
+bool_t jit_ok(dinst_t *d)
+{
+    switch (d->icode)
+    {
+    case I_NOP:
+    case I_IRMOVQ:
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_ALU:
+        return TRUE;
+    case I_RRMOVQ:
+        return d->ifun == C_YES;
+    case I_PUSHQ:
+    case I_POPQ:
+        return d->rB == REG_NONE;
+    default:
+        return FALSE;
+    }
+}
+
+/* host registers used by the emitter */
+#define H_RAX 0
+#define H_RCX 1
+#define H_RDX 2
+
+static void emit_bytes(byte_t **c, const char *bytes, int n)
+{
+    memcpy(*c, bytes, n);
+    *c += n;
+}
+
+static void emit_long(byte_t **c, long_t val, int n)
+{
+    memcpy(*c, &val, n); /* x86-64 is little-endian */
+    *c += n;
+}
+
+/* mov h, Y64 register 'id' (REG_NONE reads as 0) */
+static void emit_get_reg(byte_t **c, int h, regid_t id)
+{
+    if (id >= REG_NONE)
+    {
+        *(*c)++ = 0x31; /* xor h32, h32 */
+        *(*c)++ = 0xC0 | h << 3 | h;
+        return;
+    }
+    *(*c)++ = 0x48; /* mov h, [rbx + 8*id] */
+    *(*c)++ = 0x8B;
+    *(*c)++ = 0x43 | h << 3;
+    *(*c)++ = id * 8;
+}
+
+/* mov Y64 register 'id', h (writes to REG_NONE are dropped) */
+static void emit_set_reg(byte_t **c, int h, regid_t id)
+{
+    if (id >= REG_NONE)
+        return;
+    *(*c)++ = 0x48; /* mov [rbx + 8*id], h */
+    *(*c)++ = 0x89;
+    *(*c)++ = 0x43 | h << 3;
+    *(*c)++ = id * 8;
+}
+
+/* leave the block reporting 'k' completed instructions */
+static void emit_exit(byte_t **c, byte_t *epilogue, int k)
+{
+    *(*c)++ = 0xB8; /* mov eax, k */
+    emit_long(c, k, 4);
+    *(*c)++ = 0xE9; /* jmp epilogue */
+    emit_long(c, epilogue - (*c + 4), 4);
+}
+
+/* exit unless the block holding byte rax+off is already dirty (bt on a
+   memory operand is microcoded, so test the bit in a register) */
+static void emit_dirty_check(byte_t **c, byte_t *epilogue, int k, int off)
+{
+    emit_bytes(c, "\x48\x8D\x48", 3);         /* lea rcx, [rax + off] */
+    *(*c)++ = off;
+    emit_bytes(c, "\x48\xC1\xE9", 3);         /* shr rcx, log2(BLK_SIZE) */
+    *(*c)++ = __builtin_ctz(BLK_SIZE);
+    emit_bytes(c, "\x48\x89\xCA", 3);         /* mov rdx, rcx */
+    emit_bytes(c, "\x48\xC1\xEA\x03", 4);     /* shr rdx, 3 */
+    emit_bytes(c, "\x41\x0F\xB6\x14\x17", 5); /* movzx edx, byte [r15 + rdx] */
+    emit_bytes(c, "\x83\xE1\x07", 3);         /* and ecx, 7 */
+    emit_bytes(c, "\x0F\xA3\xCA", 3);         /* bt edx, ecx */
+    emit_bytes(c, "\x72\x0A", 2);             /* jc ok */
+    emit_exit(c, epilogue, k);
+}
+
+/* exit unless rax is a valid address of 8 bytes, and (for stores) doesn't
+   overlap cached code or, if writes are tracked, clean blocks */
+static void emit_check_addr(byte_t **c, mem_t *m, byte_t *epilogue, int k, bool_t store)
+{
+    emit_bytes(c, "\x48\x3D", 2); /* cmp rax, len-8 */
+    emit_long(c, m->len - 8, 4);
+    emit_bytes(c, "\x76\x0A", 2); /* jbe ok */
+    emit_exit(c, epilogue, k);
+    if (!store)
+        return;
+    emit_bytes(c, "\x49\x8B\x14\x06", 4); /* mov rdx, [r14 + rax] */
+    emit_bytes(c, "\x48\x85\xD2", 3);     /* test rdx, rdx */
+    emit_bytes(c, "\x74\x0A", 2);          /* jz ok */
+    emit_exit(c, epilogue, k);
+
+    if (!m->track)
+        return;
+    emit_dirty_check(c, epilogue, k, 0);
+    emit_dirty_check(c, epilogue, k, 7);
+}
+
+/* rax += imm */
+static void emit_add_imm(byte_t **c, long_t imm)
+{
+    if (imm == (int)imm)
+    {
+        emit_bytes(c, "\x48\x05", 2); /* add rax, imm32 */
+        emit_long(c, imm, 4);
+        return;
+    }
+    emit_bytes(c, "\x48\xBA", 2); /* mov rdx, imm64 */
+    emit_long(c, imm, 8);
+    emit_bytes(c, "\x48\x01\xD0", 3); /* add rax, rdx */
+}
+
+/* emit native code for the 'k'-th instruction of a block */
+static void emit_inst(byte_t **c, mem_t *m, byte_t *epilogue, int k, dinst_t *d)
+{
+    switch (d->icode)
+    {
+    case I_NOP:
+        break;
+
+    case I_RRMOVQ:
+        emit_get_reg(c, H_RAX, d->rA);
+        emit_set_reg(c, H_RAX, d->rB);
+        break;
+
+    case I_IRMOVQ:
+        emit_bytes(c, "\x48\xB8", 2); /* mov rax, imm64 */
+        emit_long(c, d->imm, 8);
+        emit_set_reg(c, H_RAX, d->rB);
+        break;
+
+    case I_RMMOVQ:
+        emit_get_reg(c, H_RAX, d->rB);
+        emit_add_imm(c, d->imm);
+        emit_check_addr(c, m, epilogue, k, TRUE);
+        emit_get_reg(c, H_RCX, d->rA);
+        emit_bytes(c, "\x49\x89\x0C\x04", 4); /* mov [r12 + rax], rcx */
+        break;
+
+    case I_MRMOVQ:
+        emit_get_reg(c, H_RAX, d->rB);
+        emit_add_imm(c, d->imm);
+        emit_check_addr(c, m, epilogue, k, FALSE);
+        emit_bytes(c, "\x49\x8B\x04\x04", 4); /* mov rax, [r12 + rax] */
+        emit_set_reg(c, H_RAX, d->rA);
+        break;
+
+    case I_ALU:
+        emit_get_reg(c, H_RCX, d->rA);
+        emit_get_reg(c, H_RAX, d->rB);
+        emit_bytes(c, "\x49\x89\x4D\x00", 4);     /* mov [r13], rcx */
+        emit_bytes(c, "\x49\x89\x45\x08", 4);     /* mov [r13 + 8], rax */
+        emit_bytes(c, "\x49\xC7\x45\x10", 4);     /* mov [r13 + 16], ifun */
+        emit_long(c, d->ifun, 4);
+        switch (d->ifun)
+        {
+        case A_ADD:
+            emit_bytes(c, "\x48\x01\xC8", 3); /* add rax, rcx */
+            break;
+        case A_SUB:
+            emit_bytes(c, "\x48\x29\xC8", 3); /* sub rax, rcx */
+            break;
+        case A_AND:
+            emit_bytes(c, "\x48\x21\xC8", 3); /* and rax, rcx */
+            break;
+        case A_XOR:
+            emit_bytes(c, "\x48\x31\xC8", 3); /* xor rax, rcx */
+            break;
+        default:
+            emit_bytes(c, "\x31\xC0", 2); /* xor eax, eax */
+            break;
+        }
+        emit_bytes(c, "\x49\x89\x45\x18", 4); /* mov [r13 + 24], rax */
+        emit_set_reg(c, H_RAX, d->rB);
+        break;
+
+    case I_PUSHQ:
+        emit_get_reg(c, H_RAX, REG_RSP);
+        emit_bytes(c, "\x48\x83\xE8\x08", 4); /* sub rax, 8 */
+        emit_check_addr(c, m, epilogue, k, TRUE);
+        emit_get_reg(c, H_RCX, d->rA);
+        emit_bytes(c, "\x49\x89\x0C\x04", 4); /* mov [r12 + rax], rcx */
+        emit_set_reg(c, H_RAX, REG_RSP);
+        break;
+
+    case I_POPQ:
+        emit_get_reg(c, H_RAX, REG_RSP);
+        emit_check_addr(c, m, epilogue, k, FALSE);
+        emit_bytes(c, "\x49\x8B\x0C\x04", 4); /* mov rcx, [r12 + rax] */
+        emit_bytes(c, "\x48\x83\xC0\x08", 4); /* add rax, 8 */
+        emit_set_reg(c, H_RAX, REG_RSP);
+        emit_set_reg(c, H_RCX, d->rA);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* drop all compiled blocks and reclaim the code buffer */
+void flush_jit(jit_t *j)
+{
+    int i;
+    for (i = 0; i < JIT_CACHE_SIZE; i++)
+        j->blocks[i].pc = -1;
+    j->used = 0;
+}
+
+jit_t *init_jit()
+{
+    jit_t *j = (jit_t *)malloc(sizeof(jit_t));
+    j->buf = (byte_t *)mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buf == MAP_FAILED)
+    {
+        free((void *)j);
+        return NULL;
+    }
+    j->blocks = (jblock_t *)malloc(JIT_CACHE_SIZE * sizeof(jblock_t));
+    j->gen = 0;
+    flush_jit(j);
+    return j;
+}
+
+/*
+ * compile_block: compile the block at jb->pc into the code buffer
+ *     (jb->n = 0 if its first instruction can't be compiled)
+ */
+void compile_block(y64sim_t *sim, jblock_t *jb)
+{
+    jit_t *j = sim->jit;
+    byte_t *c, *epilogue;
+    dinst_t *d;
+    long_t pc = jb->pc;
+
+    if (j->used + JIT_MAXLEN * JIT_INSBYTES + 64 > JIT_BUF_SIZE)
+    {
+        /* out of code space, start over (keep this entry) */
+        long_t keep = jb->pc;
+        flush_jit(j);
+        jb->pc = keep;
+        jb->count = 0;
+    }
+    c = j->buf + j->used;
+
+    epilogue = c;
+    emit_bytes(&c, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 10); /* pop r15..rbx; ret */
+    jb->fn = (jit_fn_t)c;
+    emit_bytes(&c, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9); /* push rbx..r15 */
+    emit_bytes(&c, "\x48\x89\xFB", 3); /* mov rbx, rdi */
+    emit_bytes(&c, "\x49\x89\xF4", 3); /* mov r12, rsi */
+    emit_bytes(&c, "\x49\x89\xD6", 3); /* mov r14, rdx */
+    emit_bytes(&c, "\x49\x89\xCD", 3); /* mov r13, rcx */
+    emit_bytes(&c, "\x4D\x89\xC7", 3); /* mov r15, r8 */
+
+    for (jb->n = 0; jb->n < JIT_MAXLEN; jb->n++)
+    {
+        d = fetch_inst(sim->m, pc);
+        if (!d || !jit_ok(d))
+            break;
+        jb->pcs[jb->n] = pc;
+        emit_inst(&c, sim->m, epilogue, jb->n, d);
+        pc += d->len;
+    }
+    jb->pcs[jb->n] = pc;
+    emit_exit(&c, epilogue, jb->n);
+
+    if (jb->n == 0)
+    {
+        jb->fn = NULL;
+        return;
+    }
+    j->used = c - j->buf;
+}
+
+/*
+ * run_jit: execute up to 'max_steps' instructions, interpreting with nexti()
+ *     and running hot blocks (entered JIT_HOT times after a jump, call, ret
+ *     or any other instruction the JIT leaves to nexti) as native code
+ * args
+ *     sim: the y64 image with PC, register and memory
+ *     max_steps: the step budget
+ *     steps: store the number of executed instructions
+ *
+ * return
+ *     the status of the last executed instruction (see nexti)
+ */
+stat_t run_jit(y64sim_t *sim, long_t max_steps, long_t *steps)
+{
+    jit_t *j;
+    jblock_t *jb;
+    dinst_t *d;
+    long_t step = 0;
+    int k;
+    bool_t entry = TRUE;
+    stat_t e = STAT_AOK;
+
+#if defined(__x86_64__)
+    /* native code addresses a flat image only */
+    if (!sim->jit && sim->m->data)
+        sim->jit = init_jit();
+#endif
+    if (!sim->jit)
+        return run_threaded(sim, max_steps, steps);
+    j = sim->jit;
+
+    while (step < max_steps)
+    {
+        if (j->gen != sim->m->code_gen)
+        {
+            flush_jit(j);
+            j->gen = sim->m->code_gen;
+        }
+
+        /* (pc -1 would hit an empty slot, it can't be fetched anyway) */
+        if (entry && sim->pc >= 0)
+        {
+            jb = &j->blocks[JIT_IDX(sim->pc)];
+            if (jb->pc != sim->pc)
+            {
+                jb->pc = sim->pc;
+                jb->count = 0;
+                jb->n = -1;
+                jb->fn = NULL;
+            }
+            if (jb->n < 0 && ++jb->count >= JIT_HOT)
+                compile_block(sim, jb);
+
+            if (jb->fn && jb->n <= max_steps - step)
+            {
+                k = jb->fn(sim->regs, sim->m->data, sim->m->codemap, &sim->lcc,
+                           sim->m->dirty);
+                step += k;
+                sim->pc = jb->pcs[k];
+                if (step >= max_steps)
+                    break;
+            }
+        }
+
+        /* interpret the next instruction (the one that ended the block) */
+        d = fetch_inst(sim->m, sim->pc);
+        entry = !d || !jit_ok(d);
+        e = nexti(sim);
+        step++;
+        if (e != STAT_AOK)
+            break;
+    }
+
+    *steps = step;
+    return e;
+}
+
+/*
+ * run_fused: execute both halves of the superinstruction 'd' at the PC,
+ *     exactly as two nexti() calls would
+ * return
+ *     FALSE (having changed nothing) if the first one would fault
+ */
+static bool_t run_fused(y64sim_t *sim, dinst_t *d)
+{
+    long_t valA, valB, val;
+
+    switch (d->fuse)
+    {
+    case FUSE_ADDI:
+        set_reg_val(sim->regs, d->rB, d->imm);
+        break;
+    case FUSE_LOADADD:
+        if (!get_long_val(sim->m, get_reg_val(sim->regs, d->rB) + d->imm, &val))
+            return FALSE;
+        set_reg_val(sim->regs, d->rA, val);
+        break;
+    case FUSE_CMPJ:
+        valA = get_reg_val(sim->regs, d->rA);
+        valB = get_reg_val(sim->regs, d->rB);
+        val = compute_alu(d->ifun, valA, valB);
+        set_cc_lazy(sim, d->ifun, valA, valB, val);
+        set_reg_val(sim->regs, d->rB, val);
+        sim->pc = sim_cond(sim, d->ifun2) ? d->imm2 : d->pc + d->len + d->len2;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+
+    /* the addq of FUSE_ADDI and FUSE_LOADADD */
+    valA = get_reg_val(sim->regs, d->rA2);
+    valB = get_reg_val(sim->regs, d->rB2);
+    val = compute_alu(A_ADD, valA, valB);
+    set_cc_lazy(sim, A_ADD, valA, valB, val);
+    set_reg_val(sim->regs, d->rB2, val);
+    sim->pc = d->pc + d->len + d->len2;
+    return TRUE;
+}
+
+/* run the image with the chosen engine, return status and executed steps */
+stat_t run_y64sim(y64sim_t *sim, engine_t engine, long_t max_steps, long_t *steps)
+{
+    stat_t e = STAT_AOK;
+    bool_t fuse = TRUE;
+    dinst_t *d;
+    long_t step;
+
+    /* the profiler and the models see instructions in nexti() */
+    if (sim->prof || sim->pipe || sim->bp || sim->caches || sim->trace || sim->undo ||
+        sim->mem_cb || sim->cov)
+    {
+        engine = E_INTERP;
+        fuse = FALSE;
+    }
+
+    if (engine == E_THREADED)
+        return run_threaded(sim, max_steps, steps);
+    if (engine == E_JIT)
+        return run_jit(sim, max_steps, steps);
+
+    /* execute binary code step-by-step, superinstructions count as two */
+    for (step = 0; step < max_steps && e == STAT_AOK; step++)
+    {
+        d = fetch_inst(sim->m, sim->pc);
+        if (!d)
+            e = nexti(sim);
+        else if (fuse && d->fuse && step + 1 < max_steps && run_fused(sim, d))
+            step++;
+        else
+            e = exec_inst(sim, d);
+    }
+    *steps = step;
+    return e;
+}
+
+static void put_long(FILE *f, long_t val)
+{
+    byte_t b[8];
+    store_le(b, val);
+    fwrite(b, 1, 8, f);
+}
+
+static bool_t get_long(FILE *f, long_t *val)
+{
+    byte_t b[8];
+    if (fread(b, 1, 8, f) != 8)
+        return FALSE;
+    *val = load_le(b);
+    return TRUE;
+}
+
+static const byte_t zero_blk[BLK_SIZE];
+
+/* is any byte of the block at 'addr' non-zero? (untouched pages are zero) */
+static bool_t blk_used(mem_t *m, long_t addr)
+{
+    byte_t *p = page_data(m, addr);
+
+    return p && !same_bytes(p, zero_blk, BLK_SIZE);
+}
+
+/*
+ * save_snapshot: write the state of 'sim', stopped with status 'e' after
+ *     'steps' steps, to 'fname'
+ * return
+ *     0: success
+ *     -1: error
+ */
+int save_snapshot(y64sim_t *sim, long_t steps, stat_t e, char *fname)
+{
+    mem_t *m = sim->m;
+    FILE *f;
+    long_t addr, end;
+    int i;
+
+    f = fopen(fname, "wb");
+    if (!f)
+    {
+        err_print("Can't open snapshot file '%s'", fname);
+        return -1;
+    }
+    fwrite(SNAP_MAGIC, 1, SNAP_MAGIC_LEN, f);
+    put_long(f, m->len);
+    put_long(f, sim->pc);
+    put_long(f, steps);
+    put_long(f, e);
+    put_long(f, get_cc(sim));
+    for (i = 0; i < REG_NONE; i++)
+        put_long(f, sim->regs[i]);
+
+    /* m->len is a multiple of BLK_SIZE */
+    for (addr = 0; addr < m->len; addr = end)
+    {
+        /* skip zero blocks (and untouched pages), then find the end of
+           the non-zero run */
+        if (!m->data && !page_data(m, addr))
+        {
+            end = (addr | PAGE_MASK) + 1;
+            continue;
+        }
+        end = addr + BLK_SIZE;
+        if (!blk_used(m, addr))
+            continue;
+        while (end < m->len && blk_used(m, end))
+            end += BLK_SIZE;
+        put_long(f, addr);
+        put_long(f, end - addr);
+        if (m->data)
+            fwrite(m->data + addr, 1, end - addr, f);
+        else
+            for (; addr < end; addr += BLK_SIZE)
+                fwrite(page_data(m, addr), 1, BLK_SIZE, f);
+    }
+    put_long(f, 0);
+    put_long(f, 0);
+
+    if (ferror(f) | fclose(f))
+    {
+        err_print("Failed to write snapshot file '%s'", fname);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * load_snapshot: create a y64sim from the snapshot file 'fname'
+ * args
+ *     steps: steps already run when the snapshot was taken
+ *     e: status the simulation stopped with
+ * return
+ *     the restored y64sim, NULL on error
+ */
+y64sim_t *load_snapshot(char *fname, long_t *steps, stat_t *e)
+{
+    char magic[SNAP_MAGIC_LEN];
+    long_t len, pc, nsteps, stat, cc, addr, n, k;
+    y64sim_t *sim = NULL;
+    FILE *f;
+    int i;
+
+    f = fopen(fname, "rb");
+    if (!f)
+    {
+        err_print("Can't open snapshot file '%s'", fname);
+        return NULL;
+    }
+    if (fread(magic, 1, SNAP_MAGIC_LEN, f) != SNAP_MAGIC_LEN ||
+        memcmp(magic, SNAP_MAGIC, SNAP_MAGIC_LEN) ||
+        !get_long(f, &len) || !get_long(f, &pc) || !get_long(f, &nsteps) ||
+        !get_long(f, &stat) || !get_long(f, &cc) || len <= 0 ||
+        stat < STAT_AOK || stat > STAT_INS)
+        goto bad;
+
+    sim = new_y64sim(len);
+    sim->pc = pc;
+    sim->cc = cc;
+    *steps = nsteps;
+    *e = stat;
+    for (i = 0; i < REG_NONE; i++)
+        if (!get_long(f, &sim->regs[i]))
+            goto bad;
+
+    while (1)
+    {
+        if (!get_long(f, &addr) || !get_long(f, &n))
+            goto bad;
+        if (n == 0)
+            break;
+        if (addr < 0 || n < 0 || n > len - addr)
+            goto bad;
+        if (sim->m->data)
+        {
+            if (fread(sim->m->data + addr, 1, n, f) != n)
+                goto bad;
+            continue;
+        }
+        for (; n > 0; addr += k, n -= k)
+        {
+            k = PAGE_SIZE - (addr & PAGE_MASK);
+            if (k > n)
+                k = n;
+            if (fread(get_page(sim->m, addr, TRUE)->data + (addr & PAGE_MASK), 1, k, f) != k)
+                goto bad;
+        }
+    }
+    fclose(f);
+    return sim;
+
+bad:
+    err_print("Bad snapshot file '%s'", fname);
+    fclose(f);
+    if (sim)
+        free_y64sim(sim);
+    return NULL;
+}
+
+/*
+ * libY64 (liby64.h): the simulator behind an opaque y64_t. The command line
+ * tool below is left out of the library (built with -DY64_LIB).
+ */
+
+y64_t *y64_create(int64_t memsize)
+{
+    y64sim_t *sim;
+
+    if (memsize <= 0)
+        return NULL;
+    sim = new_y64sim(memsize);
+    sim->out = NULL;
+    return sim;
+}
+
+void y64_destroy(y64_t *y)
+{
+    free_y64sim(y);
+}
+
+int y64_load(y64_t *y, const void *buf, size_t len)
+{
+    long_t memsize = y->m->len;
+
+    if (len > (size_t)memsize)
+        return -1;
+    free_mem(y->m);
+    y->m = init_mem(memsize);
+    init_dcache(y->m);
+    if (y->tcache)
+        flush_tcache(y);
+    if (y->jit)
+        flush_jit(y->jit);
+    y->pc = 0;
+    memset(y->regs, 0, sizeof(y->regs));
+    y->cc = DEFAULT_CC;
+    y->lcc.op = -1;
+    y->cov_prev = 0;
+    y->base_pc = 0;
+    memset(y->base_regs, 0, sizeof(y->base_regs));
+    y->base_cc = DEFAULT_CC;
+    return load_image(y->m, (const byte_t *)buf, len);
+}
+
+int y64_run(y64_t *y, int max_steps, int *steps)
+{
+    long_t step = 0;
+    stat_t e = STAT_AOK;
+
+    if (max_steps > 0)
+        e = run_y64sim(y, y->engine, max_steps, &step);
+    if (steps)
+        *steps = step;
+    if (e != STAT_AOK && y->halt_cb)
+        y->halt_cb(y->halt_arg, e, y->pc);
+    return e;
+}
+
+int y64_step(y64_t *y)
+{
+    return y64_run(y, 1, NULL);
+}
+
+int64_t y64_get_pc(y64_t *y)
+{
+    return y->pc;
+}
+
+void y64_set_pc(y64_t *y, int64_t pc)
+{
+    y->pc = pc;
+}
+
+int64_t y64_get_reg(y64_t *y, int reg)
+{
+    return NORM_REG(reg) ? y->regs[reg] : 0;
+}
+
+int y64_set_reg(y64_t *y, int reg, int64_t val)
+{
+    if (!NORM_REG(reg))
+        return -1;
+    y->regs[reg] = val;
+    return 0;
+}
+
+int y64_get_cc(y64_t *y)
+{
+    return get_cc(y);
+}
+
+int64_t y64_memsize(y64_t *y)
+{
+    return y->m->len;
+}
+
+int y64_read(y64_t *y, int64_t addr, void *buf, size_t len)
+{
+    byte_t *p = (byte_t *)buf;
+    byte_t *data;
+    size_t n;
+
+    if (len > (size_t)y->m->len || !IN_MEM(y->m, addr, (long_t)len))
+        return -1;
+    /* a page at a time, untouched pages read as zero */
+    for (; len > 0; addr += n, p += n, len -= n)
+    {
+        n = y->m->data ? len : PAGE_SIZE - (addr & PAGE_MASK);
+        if (n > len)
+            n = len;
+        data = page_data(y->m, addr);
+        if (data)
+            memcpy(p, data, n);
+        else
+            memset(p, 0, n);
+    }
+    return 0;
+}
+
+/* like set_byte_val() on each byte: decoded and compiled code over them is
+   dropped, and they are marked dirty after y64_snapshot() */
+int y64_write(y64_t *y, int64_t addr, const void *buf, size_t len)
+{
+    const byte_t *p = (const byte_t *)buf;
+    mem_t *m = y->m;
+    byte_t *data, *code;
+    page_t *pg;
+    size_t n;
+
+    if (len > (size_t)m->len || !IN_MEM(m, addr, (long_t)len))
+        return -1;
+    /* a page at a time (all of a flat image at once) */
+    for (; len > 0; addr += n, p += n, len -= n)
+    {
+        if (m->data)
+        {
+            n = len;
+            data = m->data + addr;
+            code = m->codemap + addr;
+        }
+        else
+        {
+            n = PAGE_SIZE - (addr & PAGE_MASK);
+            if (n > len)
+                n = len;
+            pg = get_page(m, addr, TRUE);
+            data = pg->data + (addr & PAGE_MASK);
+            code = pg->code ? pg->code + (addr & PAGE_MASK) : NULL;
+        }
+        if (m->track)
+            mark_dirty(m, addr, n);
+        /* codemap flags are 0 or 1 */
+        if (code && memchr(code, 1, n))
+            invalidate_code(m, addr, n);
+        memcpy(data, p, n);
+    }
+    return 0;
+}
+
+int y64_set_engine(y64_t *y, int engine)
+{
+    if (engine < E_INTERP || engine > E_JIT)
+        return -1;
+    y->engine = (engine_t)engine;
+    return 0;
+}
+
+void y64_set_output(y64_t *y, FILE *out)
+{
+    y->out = out;
+}
+
+void y64_on_mem(y64_t *y, y64_mem_cb cb, void *arg)
+{
+    y->mem_cb = cb;
+    y->mem_arg = arg;
+}
+
+void y64_on_halt(y64_t *y, y64_halt_cb cb, void *arg)
+{
+    y->halt_cb = cb;
+    y->halt_arg = arg;
+}
+
+void y64_snapshot(y64_t *y)
+{
+    track_mem(y->m);
+    y->base_pc = y->pc;
+    memcpy(y->base_regs, y->regs, sizeof(y->regs));
+    y->base_cc = get_cc(y);
+}
+
+void y64_reset(y64_t *y)
+{
+    reset_dirty(y->m);
+    y->pc = y->base_pc;
+    memcpy(y->regs, y->base_regs, sizeof(y->regs));
+    y->cc = y->base_cc;
+    y->lcc.op = -1;
+    y->cov_prev = 0;
+}
+
+int y64_coverage(y64_t *y, unsigned char *map, size_t size)
+{
+    if (map && (size == 0 || (size & (size - 1))))
+        return -1;
+    y->cov = map;
+    y->cov_mask = size - 1;
+    y->cov_prev = 0;
+    return 0;
+}
+
+const char *y64_status_name(int status)
+{
+    return stat_name((stat_t)status);
+}
+
+#ifndef Y64_LIB
+
+/* seconds on a monotonic clock */
+static double now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define WATCH_SLICE (1<<20) /* steps between looks at the clock */
+
+/*
+ * run_watched: like run_y64sim(), but with a time limit or progress reports
+ *     it runs in slices of WATCH_SLICE steps, looking at the clock between
+ *     them (the result is the same as one run of as many steps)
+ */
+static stat_t run_watched(y64sim_t *sim, simopt_t *opt, long_t max_steps, long_t *steps)
+{
+    double start, t, last;
+    long_t step = 0, last_step = 0;
+    long_t n, k;
+    stat_t e = STAT_AOK;
+
+    if (opt->time_limit <= 0 && opt->progress <= 0)
+        return run_y64sim(sim, opt->engine, max_steps, steps);
+
+    start = last = now_secs();
+    while (step < max_steps && e == STAT_AOK)
+    {
+        n = max_steps - step < WATCH_SLICE ? max_steps - step : WATCH_SLICE;
+        e = run_y64sim(sim, opt->engine, n, &k);
+        step += k;
+        t = now_secs();
+        if (opt->progress > 0 && t - last >= opt->progress)
+        {
+            fprintf(stderr, "%9.1fs %12ld steps %10.2f M steps/s  PC = 0x%lx\n", t - start,
+                    step, (step - last_step) / (t - last) / 1e6, sim->pc);
+            last = t;
+            last_step = step;
+        }
+        if (opt->time_limit > 0 && t - start >= opt->time_limit && step < max_steps &&
+            e == STAT_AOK)
+        {
+            fprintf(stderr, "Time limit of %gs reached after %ld steps\n", opt->time_limit, step);
+            break;
+        }
+    }
+    *steps = step;
+    return e;
+}
+
+/*
+ * rewind_y64sim: take back opt->rewind steps, or the steps after the last
+ *     write to opt->watch_addr, leaving 'sim' as if it had stopped there
+ */
+static void rewind_y64sim(y64sim_t *sim, simopt_t *opt, long_t *step, stat_t *e, FILE *out)
+{
+    long_t n = opt->rewind;
+    long_t k;
+
+    if (opt->watch)
+    {
+        k = undo_find_write(sim->undo, opt->watch_addr);
+        if (k < 0)
+        {
+            fprintf(out, "No write to 0x%lx in the last %ld steps\n",
+                    opt->watch_addr, sim->undo->n);
+            return;
+        }
+        n = k - 1;
+        fprintf(out, "Last write to 0x%lx at step %ld, PC = 0x%lx\n", opt->watch_addr,
+                *step - n, sim->undo->recs[(sim->undo->head + sim->undo->cap - k) %
+                                           sim->undo->cap].pc);
+    }
+    if (n > sim->undo->n)
+    {
+        fprintf(out, "Can't rewind %ld steps, only %ld are logged\n", n, sim->undo->n);
+        n = sim->undo->n;
+    }
+    for (k = 0; k < n; k++)
+        undo_step(sim);
+    if (n > 0)
+    {
+        *step -= n;
+        *e = STAT_AOK;
+    }
+}
+
+/*
+ * run_loaded: run 'sim' (which has already run 'step0' steps, stopping
+ *     with status 'e') up to opt->max_steps steps in total, print the
+ *     changes (and the profile), then save a snapshot if asked to
+ */
+static int run_loaded(y64sim_t *sim, long_t step0, stat_t e, simopt_t *opt,
+                      FILE *out, job_t *res)
+{
+    long_t saver[REG_NONE];
+    long_t step = 0;
+    int ret = 0;
+
+    /* save initial register and memory stat */
+    memcpy(saver, sim->regs, sizeof(saver));
+    track_mem(sim->m);
+    if (opt->profile)
+        sim->prof = new_prof();
+    if (opt->pipeline)
+    {
+        sim->pipe = (pipe_t *)calloc(1, sizeof(pipe_t));
+        sim->pipe->load_dst = REG_NONE;
+    }
+    if (opt->predictors)
+        sim->bp = new_bpsim();
+    if (opt->caches)
+        sim->caches = new_caches(opt->cache_cfg);
+    if (opt->rewind || opt->watch)
+        sim->undo = new_undo(opt->max_steps - step0 < UNDO_MAX ? opt->max_steps - step0
+                                                               : UNDO_MAX);
+    if (opt->tracefile && !(sim->trace = open_trace(opt->tracefile, opt->trace_fetches)))
+    {
+        free_y64sim(sim);
+        return -1;
+    }
+
+    if (e == STAT_AOK)
+        e = run_watched(sim, opt, opt->max_steps - step0, &step);
+    step += step0;
+
+    if (sim->undo)
+        rewind_y64sim(sim, opt, &step, &e, out);
+
+    /* print final stat of y64sim */
+    fprintf(out, "Stopped in %ld steps at PC = 0x%lx.  Status '%s', CC %s\n",
+            step, sim->pc, stat_name(e), cc_name(get_cc(sim)));
+
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(saver, sim->regs, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_dirty(sim->m, out);
+
+    if (sim->prof)
+        print_prof(sim->prof, sim->m, out);
+    if (sim->pipe)
+        print_pipe(sim->pipe, out);
+    if (sim->bp)
+        print_bpsim(sim->bp, out);
+    if (sim->caches)
+        print_caches(sim->caches, out);
+
+    if (sim->trace && close_trace(sim->trace) < 0)
+    {
+        err_print("Failed to write trace file '%s'", opt->tracefile);
+        ret = -1;
+    }
+    sim->trace = NULL;
+    if (opt->snapfile && save_snapshot(sim, step, e, opt->snapfile) < 0)
+        ret = -1;
+    if (res)
+    {
+        res->steps = step;
+        res->pc = sim->pc;
+        res->e = e;
+    }
+    free_y64sim(sim);
+    return ret;
+}
+
+/*
+ * run_snapshot: like run_binfile(), starting from a snapshot; changes are
+ *     reported against the snapshot, steps include the ones it was taken at
+ */
+int run_snapshot(char *fname, simopt_t *opt, FILE *out)
+{
+    y64sim_t *sim;
+    long_t step0;
+    stat_t e;
+
+    sim = load_snapshot(fname, &step0, &e);
+    if (!sim)
+        return -1;
+    sim->out = out;
+    return run_loaded(sim, step0, e, opt, out, NULL);
+}
+
+/*
+ * run_binfile: load a .bin image, run it and print its final state
+ * args
+ *     fname: the .bin file
+ *     engine, max_steps: how to run it
+ *     memsize: bytes of Y64 memory
+ *     out: where the report (and fault messages) go
+ *     res: filled with the final status, steps and PC (may be NULL)
+ *
+ * return
+ *     0: success
+ *     -1: error, the file can't be opened or loaded
+ */
+int run_binfile(char *fname, simopt_t *opt, FILE *out, job_t *res)
+{
+    FILE *binfile;
+    y64sim_t *sim;
+
+    binfile = fopen(fname, "rb");
+    if (!binfile)
+    {
+        err_print("Can't open binary file '%s'", fname);
+        return -1;
+    }
+
+    sim = new_y64sim(opt->memsize);
+    sim->out = out;
+    if (load_binfile(sim->m, binfile) < 0)
+    {
+        err_print("Failed to load binary file '%s'", fname);
+        fclose(binfile);
+        free_y64sim(sim);
+        return -1;
+    }
+    fclose(binfile);
+
+    return run_loaded(sim, 0, STAT_AOK, opt, out, res);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * run_bench: run a .bin image 'n' times, each from a fresh load, and print
+ *     the speed of every run and their median in millions of instructions
+ *     per second (loading isn't timed)
+ * return
+ *     0: success
+ *     -1: error, the file can't be opened or loaded
+ */
+static int run_bench(char *fname, int n, simopt_t *opt)
+{
+    double *mips = (double *)malloc(n * sizeof(double));
+    double t, median;
+    y64sim_t *sim;
+    FILE *binfile;
+    long_t step;
+    int i;
+    stat_t e;
+
+    for (i = 0; i < n; i++)
+    {
+        binfile = fopen(fname, "rb");
+        if (!binfile)
+        {
+            err_print("Can't open binary file '%s'", fname);
+            free((void *)mips);
+            return -1;
+        }
+        sim = new_y64sim(opt->memsize);
+        sim->out = NULL;
+        if (load_binfile(sim->m, binfile) < 0)
+        {
+            err_print("Failed to load binary file '%s'", fname);
+            fclose(binfile);
+            free_y64sim(sim);
+            free((void *)mips);
+            return -1;
+        }
+        fclose(binfile);
+
+        t = now_secs();
+        e = run_watched(sim, opt, opt->max_steps, &step);
+        t = now_secs() - t;
+        mips[i] = t > 0 ? step / t / 1e6 : 0;
+        printf("Run %d: %ld steps in %.3fs, %.2f MIPS, status '%s'\n", i + 1, step, t,
+               mips[i], stat_name(e));
+        free_y64sim(sim);
+    }
+
+    qsort(mips, n, sizeof(double), cmp_double);
+    median = n & 1 ? mips[n / 2] : (mips[n / 2 - 1] + mips[n / 2]) / 2;
+    printf("Median of %d runs: %.2f MIPS (min %.2f, max %.2f)\n", n, median, mips[0],
+           mips[n - 1]);
+    free((void *)mips);
+    return 0;
+}
+
+/* batch_worker: take jobs until none is left, writing each to <image>.sim */
+void *batch_worker(void *arg)
+{
+    batch_t *b = (batch_t *)arg;
+    job_t *job;
+    char *simname;
+    FILE *out;
+    int len;
+
+    while (1)
+    {
+        pthread_mutex_lock(&b->lock);
+        job = b->next < b->njobs ? &b->jobs[b->next++] : NULL;
+        pthread_mutex_unlock(&b->lock);
+        if (!job)
+            return NULL;
+
+        len = strlen(job->fname);
+        simname = (char *)malloc(len + 1);
+        strcpy(simname, job->fname);
+        strcpy(simname + len - 4, ".sim");
+        out = fopen(simname, "w");
+        if (!out)
+        {
+            err_print("Can't open output file '%s'", simname);
+        }
+        else
+        {
+            job->loaded = !run_binfile(job->fname, b->opt, out, job);
+            fclose(out);
+        }
+        free((void *)simname);
+    }
+}
+
+static int is_binfile(const char *fname)
+{
+    int len = strlen(fname);
+    return len >= 4 && !strcmp(fname + len - 4, ".bin");
+}
+
+static void add_job(batch_t *b, const char *fname, int *cap)
+{
+    if (b->njobs == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        b->jobs = (job_t *)realloc(b->jobs, *cap * sizeof(job_t));
+    }
+    memset(&b->jobs[b->njobs], 0, sizeof(job_t));
+    b->jobs[b->njobs].fname = strdup(fname);
+    b->njobs++;
+}
+
+static int cmp_job(const void *a, const void *b)
+{
+    return strcmp(((job_t *)a)->fname, ((job_t *)b)->fname);
+}
+
+/*
+ * add_jobs: queue 'path', which is a .bin image, a directory (all of its
+ *     .bin images, sorted by name) or a list file (one path per line)
+ */
+void add_jobs(batch_t *b, char *path, int *cap)
+{
+    DIR *dir;
+    struct dirent *de;
+    FILE *list;
+    char buf[1024];
+    int first, len;
+
+    if (is_binfile(path))
+    {
+        add_job(b, path, cap);
+        return;
+    }
+
+    if ((dir = opendir(path)) != NULL)
+    {
+        first = b->njobs;
+        while ((de = readdir(dir)) != NULL)
+        {
+            if (!is_binfile(de->d_name))
+                continue;
+            snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+            add_job(b, buf, cap);
+        }
+        closedir(dir);
+        qsort(b->jobs + first, b->njobs - first, sizeof(job_t), cmp_job);
+        return;
+    }
+
+    list = fopen(path, "r");
+    if (!list)
+    {
+        err_print("Can't open '%s'", path);
+        return;
+    }
+    while (fgets(buf, sizeof(buf), list))
+    {
+        len = strlen(buf);
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r' || buf[len - 1] == ' '))
+            buf[--len] = '\0';
+        if (len > 0 && is_binfile(buf))
+            add_job(b, buf, cap);
+    }
+    fclose(list);
+}
+
+/*
+ * run_batch: run every image named in 'paths' on 'nthreads' worker threads,
+ *     writing <image>.sim for each and a one-line summary to stdout
+ *
+ * return
+ *     the number of images that couldn't be run
+ */
+int run_batch(char **paths, int npaths, int nthreads, simopt_t *opt)
+{
+    batch_t b;
+    pthread_t tids[MAX_THREADS];
+    int i, cap = 0, failed = 0;
+
+    memset(&b, 0, sizeof(b));
+    for (i = 0; i < npaths; i++)
+        add_jobs(&b, paths[i], &cap);
+    b.opt = opt;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (nthreads > b.njobs)
+        nthreads = b.njobs;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, batch_worker, &b);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    for (i = 0; i < b.njobs; i++)
+    {
+        job_t *job = &b.jobs[i];
+        if (job->loaded)
+            printf("%s: Stopped in %ld steps at PC = 0x%lx.  Status '%s'\n",
+                   job->fname, job->steps, job->pc, stat_name(job->e));
+        else
+        {
+            printf("%s: failed\n", job->fname);
+            failed++;
+        }
+        free((void *)job->fname);
+    }
+    pthread_mutex_destroy(&b.lock);
+    free((void *)b.jobs);
+    return failed;
+}
+
+/*
+ * parse_caches: parse a comma separated list of level=s:E:b (levels l1i,
+ *     l1d and l2) into 'cfg', or 'default'
+ * return
+ *     0: success
+ *     -1: error
+ */
+int parse_caches(char *spec, int cfg[NUM_CACHE][3])
+{
+    static char *names[] = {"l1i", "l1d", "l2"};
+    char *item, *save;
+    int i, s, E, b, n;
+
+    if (!strcmp(spec, "default"))
+        return 0;
+    for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        for (i = 0; i < NUM_CACHE; i++)
+            if (!strncmp(item, names[i], strlen(names[i])) && item[strlen(names[i])] == '=')
+                break;
+        if (i == NUM_CACHE ||
+            sscanf(item + strlen(names[i]) + 1, "%d:%d:%d%n", &s, &E, &b, &n) != 3 ||
+            item[strlen(names[i]) + 1 + n] || s < 0 || s > 24 || E < 1 || b < 0 || b > 24)
+        {
+            err_print("Bad cache spec '%s'", item);
+            return -1;
+        }
+        cfg[i][0] = s;
+        cfg[i][1] = E;
+        cfg[i][2] = b;
+    }
+    return 0;
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [options] [-m memsize] [-s snapshot] [-T trace] file.bin [max_steps]\n", pname);
+    printf("   Or: %s [options] [-s snapshot] [-T trace] -r snapshot [max_steps]\n", pname);
+    printf("   Or: %s [options] [-m memsize] [-j threads] [-n max_steps] -b (file.bin|dir|list)...\n", pname);
+    printf("   Or: %s [options] [-m memsize] --bench N file.bin [max_steps]\n", pname);
+    printf("   -e execution engine: interp (default, nexti step-by-step)\n");
+    printf("                        threaded (direct-threaded basic blocks)\n");
+    printf("                        jit (hot basic blocks as native x86-64 code)\n");
+    printf("   -m bytes of Y64 memory, K/M/G suffixes allowed (default 0x%x),\n", MEM_SIZE);
+    printf("      images over 0x%x bytes are paged in on first write\n", FLAT_MAX);
+    printf("   -b batch mode: run every image (a .bin, all .bin in a directory, or\n");
+    printf("      the ones listed in a file) and write the results to <image>.sim\n");
+    printf("   -j worker threads for batch mode (default: number of CPUs)\n");
+    printf("   -n max steps for batch mode (default %d)\n", MAX_STEP);
+    printf("   -s save the final state (pc, registers, cc, memory) to a snapshot\n");
+    printf("   -R take back this many steps after the run (at most %d)\n", UNDO_MAX);
+    printf("   -W go back to just after the last write to this address\n");
+    printf("      (-R and -W keep an undo log, which runs on the interp engine)\n");
+    printf("   -r resume from a snapshot, max_steps counts the steps before it too\n");
+    printf("   -L, --time-limit stop after this many seconds of wall-clock time\n");
+    printf("      (without max_steps or -n, there is no step limit)\n");
+    printf("   -P, --progress print steps/s and the PC to stderr every this many seconds\n");
+    printf("   --bench run file.bin N times and print the median speed in MIPS\n");
+    printf("Reports printed after the changes (these run on the interp engine):\n");
+    printf("   -p profile: instruction mix, hot PCs, jumps taken and call targets\n");
+    printf("   -t time the run on the PIPE pipeline: cycles, CPI and stalls\n");
+    printf("   -B branch predictors: misses of always-taken, btfnt, bimodal, gshare\n");
+    printf("      and a return address stack\n");
+    printf("   -c simulate L1I/L1D/L2 caches, 'default' or a list like l1d=s:E:b,l2=s:E:b\n");
+    printf("      (default l1i=6:8:6,l1d=6:8:6,l2=9:8:6)\n");
+    printf("   -T write the loads and stores to a trace file in valgrind lackey format\n");
+    printf("      (as read by csim), -I adds instruction fetches\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    simopt_t opt = {E_INTERP, MAX_STEP, MEM_SIZE, NULL, FALSE, FALSE, FALSE, FALSE,
+                    CACHE_DEFAULTS, NULL, FALSE, 0, FALSE, 0, 0, 0};
+    static struct option longopts[] = {
+        {"time-limit", required_argument, NULL, 'L'},
+        {"progress", required_argument, NULL, 'P'},
+        {"bench", required_argument, NULL, 'N'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    bool_t batch = FALSE;
+    bool_t steps_given = FALSE;
+    int bench = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *fname;
+    char *restore = NULL;
+    char *end;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "e:bj:n:m:s:r:R:W:ptBc:T:IL:P:h", longopts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'e':
+            if (!strcmp(optarg, "interp"))
+                opt.engine = E_INTERP;
+            else if (!strcmp(optarg, "threaded"))
+                opt.engine = E_THREADED;
+            else if (!strcmp(optarg, "jit"))
+                opt.engine = E_JIT;
+            else
+                usage(argv[0]);
+            break;
+        case 'b':
+            batch = TRUE;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            opt.max_steps = atol(optarg);
+            steps_given = TRUE;
+            break;
+        case 'm':
+            opt.memsize = strtol(optarg, &end, 0);
+            if (*end == 'K' || *end == 'k')
+                opt.memsize <<= 10;
+            else if (*end == 'M' || *end == 'm')
+                opt.memsize <<= 20;
+            else if (*end == 'G' || *end == 'g')
+                opt.memsize <<= 30;
+            if (opt.memsize <= 0)
+                usage(argv[0]);
+            break;
+        case 's':
+            opt.snapfile = optarg;
+            break;
+        case 'r':
+            restore = optarg;
+            break;
+        case 'p':
+            opt.profile = TRUE;
+            break;
+        case 't':
+            opt.pipeline = TRUE;
+            break;
+        case 'B':
+            opt.predictors = TRUE;
+            break;
+        case 'R':
+            opt.rewind = atoi(optarg);
+            if (opt.rewind < 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            opt.watch = TRUE;
+            opt.watch_addr = strtol(optarg, &end, 0);
+            if (*end)
+                usage(argv[0]);
+            break;
+        case 'T':
+            opt.tracefile = optarg;
+            break;
+        case 'I':
+            opt.trace_fetches = TRUE;
+            break;
+        case 'c':
+            opt.caches = TRUE;
+            if (parse_caches(optarg, opt.cache_cfg) < 0)
+                usage(argv[0]);
+            break;
+        case 'L':
+            opt.time_limit = strtod(optarg, &end);
+            if (*end || opt.time_limit <= 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            opt.progress = strtod(optarg, &end);
+            if (*end || opt.progress <= 0)
+                usage(argv[0]);
+            break;
+        case 'N':
+            bench = atoi(optarg);
+            if (bench < 1)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* a time limit alone runs until the clock stops it (a max_steps argument still counts) */
+    if (opt.time_limit > 0 && !steps_given)
+        opt.max_steps = NO_STEP_LIMIT;
+
+    if (batch)
+    {
+        if (argc - optind < 1 || opt.snapfile || opt.tracefile || restore || opt.progress ||
+            bench)
+            usage(argv[0]);
+        if (nthreads < 1)
+            nthreads = 1;
+        if (nthreads > MAX_THREADS)
+            nthreads = MAX_THREADS;
+        return run_batch(argv + optind, argc - optind, nthreads, &opt) ? 1 : 0;
+    }
+
+    if (restore)
+    {
+        if (argc - optind > 1 || bench)
+            usage(argv[0]);
+        if (argc - optind > 0)
+            opt.max_steps = atol(argv[optind]);
+        return run_snapshot(restore, &opt, stdout) < 0 ? 1 : 0;
+    }
+
+    if (argc - optind < 1 || argc - optind > 2)
+        usage(argv[0]);
+    fname = argv[optind];
+
+    /* set max steps */
+    if (argc - optind > 1)
+        opt.max_steps = atol(argv[optind + 1]);
+
+    /* load binary file to memory */
+    if (!is_binfile(fname))
+        usage(argv[0]); /* only support *.bin file */
+
+    /* the reports and the undo log would be timed too */
+    if (bench)
+    {
+        if (opt.snapfile || opt.tracefile || opt.profile || opt.pipeline || opt.predictors ||
+            opt.caches || opt.rewind || opt.watch)
+            usage(argv[0]);
+        return run_bench(fname, bench, &opt) < 0 ? 1 : 0;
+    }
+
+    if (run_binfile(fname, &opt, stdout, NULL) < 0)
+        exit(1);
+
+    return 0;
+}
+
+;
+
+#endif
@@ -5,12 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+
+#include "liby64.h"
 
 #define MAX_STEP 10000
+#define NO_STEP_LIMIT INT64_MAX /* -L without max_steps */
 
 #define BLK_SIZE 32
 #define MEM_SIZE (1<<13)
-#define REG_SIZE 15*8
 
 typedef unsigned char byte_t;
 typedef int64_t long_t;
@@ -67,17 +70,341 @@ typedef enum { D_DATA, D_POS, D_ALIGN } dtv_t;
 #define GET_REGB(byte0) LOW(byte0)
 
 
+/* Simulator status */
+typedef enum { STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS } stat_t;
+
+/* Decoded instruction, cached by PC to skip re-fetching and re-decoding */
+#define DCACHE_SIZE (1<<12)
+#define DCACHE_IDX(pc) ((pc) & (DCACHE_SIZE-1))
+#define MAX_INSLEN 10
+
+/* Superinstructions: pairs the interpreter runs in one go */
+typedef enum { FUSE_NONE,
+    FUSE_ADDI,      /* irmovq V, rX; addq rA, rB */
+    FUSE_CMPJ,      /* subq/andq rA, rB; jXX Dest */
+    FUSE_LOADADD    /* mrmovq D(rB), rA; addq rA', rB' */
+} fuse_t;
+
+#define MAX_FUSELEN (2 * MAX_INSLEN)
+
+typedef struct dinst {
+    long_t pc;      /* tag: address of this instruction, -1 if empty */
+    itype_t icode;
+    byte_t ifun;
+    regid_t rA;
+    regid_t rB;
+    long_t imm;
+    int len;        /* bytes taken by the instruction */
+    struct prof_ent *prof;  /* profile counters of 'pc', NULL: look up */
+    fuse_t fuse;    /* the second half of a superinstruction follows */
+    byte_t ifun2;
+    regid_t rA2;
+    regid_t rB2;
+    long_t imm2;
+    int len2;
+} dinst_t;
+
+/* Paged memory: dir[addr >> DIR_SHIFT][(addr >> PAGE_SHIFT) % DIR_PAGES],
+   pages are allocated on first write */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1<<PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE-1)
+#define DIR_SHIFT 22
+#define DIR_PAGES (1<<(DIR_SHIFT-PAGE_SHIFT))
+#define FLAT_MAX (1<<20)    /* larger images are paged */
+
+#define DIRTY_BYTES(len) (((len) / BLK_SIZE + 7) / 8)
+
+typedef struct page {
+    byte_t data[PAGE_SIZE];
+    byte_t *code;       /* codemap of this page, NULL if it holds no code */
+    byte_t dirty[DIRTY_BYTES(PAGE_SIZE)];
+    byte_t *saved;      /* original contents of dirty blocks, NULL if none */
+} page_t;
+
 typedef struct mem {
-    int len;
-    byte_t *data;
+    long_t len;
+    byte_t *data;       /* flat image, NULL if paged */
+    page_t ***dir;      /* page directory of a paged image */
+    long_t ndir;
+    byte_t *codemap;    /* flat: one flag per byte covered by a cached decode */
+    dinst_t *dcache;    /* NULL if this image is not executed */
+    int code_gen;       /* bumped whenever cached code is overwritten */
+    bool_t track;       /* record writes since track_mem() */
+    byte_t *dirty;      /* flat: one bit per BLK_SIZE block written */
+    byte_t *saved;      /* flat: original contents of dirty blocks */
 } mem_t;
 
+/* Lazily evaluated condition codes: the last ALU op, operands and result
+   (field offsets are known to the JIT) */
+typedef struct lazy_cc {
+    long_t valA;
+    long_t valB;
+    long_t op;      /* -1 if cc is up to date */
+    long_t val;
+} lazy_cc_t;
+
+/* Execution engines */
+typedef enum { E_INTERP, E_THREADED, E_JIT } engine_t;
+
+/* Threaded code: a basic block translated to an array of handler labels */
+#define TB_CACHE_SIZE (1<<10)
+#define TB_IDX(pc) ((pc) & (TB_CACHE_SIZE-1))
+#define TB_MAXLEN 32
+
+typedef struct tinst {
+    void *op;       /* handler label in run_threaded() */
+    byte_t ifun;
+    regid_t rA;
+    regid_t rB;
+    long_t imm;
+    long_t next_pc;
+} tinst_t;
+
+typedef struct tblock {
+    long_t pc;      /* entry PC, -1 if empty */
+    int n;          /* translated instructions, code[n] exits the block */
+    tinst_t code[TB_MAXLEN + 1];
+} tblock_t;
+
+/* JIT: hot basic blocks compiled to native x86-64 code */
+#define JIT_CACHE_SIZE (1<<10)
+#define JIT_IDX(pc) ((pc) & (JIT_CACHE_SIZE-1))
+#define JIT_MAXLEN 32
+#define JIT_HOT 16                  /* entries before a block is compiled */
+#define JIT_BUF_SIZE (1<<20)
+#define JIT_INSBYTES 192            /* upper bound of native bytes per instr */
+
+/* returns the number of instructions completed */
+typedef int (*jit_fn_t)(long_t *regs, byte_t *mem, byte_t *codemap, lazy_cc_t *lcc,
+                        byte_t *dirty);
+
+typedef struct jblock {
+    long_t pc;      /* entry PC, -1 if empty */
+    int count;      /* entries seen so far */
+    int n;          /* compiled instructions, -1 if not compiled yet */
+    jit_fn_t fn;    /* NULL if nothing at 'pc' can be compiled */
+    long_t pcs[JIT_MAXLEN + 1];  /* PC of each instruction, pcs[n] ends */
+} jblock_t;
+
+typedef struct jit {
+    jblock_t *blocks;
+    byte_t *buf;    /* mmap'd executable code buffer */
+    int used;
+    int gen;        /* mem_t.code_gen the blocks were compiled from */
+} jit_t;
+
+/* Profiler: counts per instruction kind, per PC and per call target */
+#define PROF_TOP 20         /* PCs and call targets listed in the report */
+#define PROF_DEPTH 1024     /* shadow call stack for inclusive counts */
+
+typedef struct prof_ent {
+    long_t pc;      /* -1 if empty */
+    long_t count;   /* executions, or calls for a call target */
+    bool_t cond;    /* a conditional jump */
+    long_t taken;   /* conditional jumps: times taken */
+    long_t steps;   /* call targets: instructions until the matching ret */
+} prof_ent_t;
+
+typedef struct prof_tab {
+    prof_ent_t *ents;   /* open addressing, 'cap' is a power of 2 */
+    long_t cap;
+    long_t n;
+} prof_tab_t;
+
+typedef struct prof {
+    long_t steps;
+    long_t ops[I_DIRECTIVE + 1][16];    /* by icode (I_DIRECTIVE: invalid), ifun */
+    long_t taken, not_taken;            /* conditional jumps */
+    prof_tab_t pcs;
+    prof_tab_t calls;
+    long_t stack[PROF_DEPTH][2];        /* call target, steps at the call */
+    int depth;
+} prof_t;
+
+/*
+ * PIPE timing model: the five-stage pipeline of CS:APP 4.5 (forwarding,
+ * jumps predicted taken), fed with the instructions nexti() executes
+ */
+#define PIPE_FILL 4         /* cycles until the first instruction retires */
+#define LOAD_USE_BUBBLES 1
+#define MISPREDICT_BUBBLES 2
+#define RET_BUBBLES 3
+
+typedef struct pipe {
+    long_t insts;
+    long_t load_use;    /* hazards found, each costs LOAD_USE_BUBBLES */
+    long_t mispredict;  /* ...MISPREDICT_BUBBLES */
+    long_t ret;         /* ...RET_BUBBLES */
+    regid_t load_dst;   /* dstM of the previous mrmovq/popq, else REG_NONE */
+} pipe_t;
+
+/*
+ * Branch predictors, all run side by side on the conditional jumps (and a
+ * return address stack on call/ret) that nexti() executes
+ */
+#define BHT_BITS 12         /* 2-bit counters in the bimodal/gshare tables */
+#define RAS_DEPTH 16
+
+typedef struct bpred {
+    char *name;
+    bool_t (*predict)(struct bpred *bp, long_t pc, long_t target);
+    void (*update)(struct bpred *bp, long_t pc, bool_t taken);
+    int hist_bits;      /* outcomes kept in 'hist' (gshare), 0: none */
+    byte_t *bht;        /* 2-bit counters, NULL for static predictors */
+    long_t hist;        /* global history, xor'ed into the table index */
+    long_t misses;
+} bpred_t;
+
+#define NUM_BPRED 4
+
+typedef struct bpsim {
+    bpred_t preds[NUM_BPRED];
+    long_t jumps;       /* conditional jumps */
+    long_t ras[RAS_DEPTH];  /* circular, the oldest entries are overwritten */
+    int ras_n;              /* entries pushed and not popped yet */
+    int ras_top;
+    long_t rets;
+    long_t ras_misses;
+} bpsim_t;
+
+/*
+ * Cache model (as csim in the cache lab: LRU, write-allocate), fed with the
+ * fetches, loads and stores of the instructions nexti() executes. L1I and
+ * L1D misses go on to L2. A load or store is one access to the block holding
+ * its address, like a trace line to csim; a fetch accesses every block the
+ * instruction spans.
+ */
+typedef enum { C_L1I, C_L1D, C_L2, NUM_CACHE } clevel_t;
+
+/* default s, E, b of each level: 32K/32K/256K, 8-way, 64-byte blocks */
+#define CACHE_DEFAULTS {{6, 8, 6}, {6, 8, 6}, {9, 8, 6}}
+
+typedef struct cline {
+    bool_t valid;
+    long_t tag;
+    long_t lru;     /* time of the last access */
+} cline_t;
+
+typedef struct cache {
+    int s, E, b;
+    cline_t *lines;     /* (1 << s) sets of E lines */
+    long_t clock;
+    long_t hits, misses, evictions;
+    struct cache *next; /* where misses go, NULL: memory */
+} cache_t;
+
+/* Memory trace in valgrind lackey format (what csim reads), buffered */
+#define TRACE_BUF_SIZE (1<<20)
+#define TRACE_LINE_MAX 32   /* "I  " + 16 hex digits + ",10\n" fits */
+
+typedef struct trace {
+    int fd;
+    bool_t fetches;     /* also write I lines */
+    bool_t failed;      /* a write() failed, nothing more is written */
+    int used;
+    char buf[TRACE_BUF_SIZE];
+} trace_t;
+
+/*
+ * Undo log: what each step is about to overwrite, so steps can be taken
+ * back. Only the last UNDO_MAX steps are kept.
+ */
+#define UNDO_MAX (1<<22)
+
+typedef struct undo_rec {
+    long_t pc;
+    long_t addr;        /* of the 8 bytes stored to, -1 if none */
+    long_t old;         /* their contents */
+    long_t rval[2];
+    regid_t reg[2];     /* registers written, REG_NONE if fewer */
+    cc_t cc;
+} undo_rec_t;
+
+typedef struct undo {
+    undo_rec_t *recs;   /* ring of 'cap' records */
+    long_t cap;
+    long_t n;           /* records kept (at most 'cap') */
+    long_t head;        /* where the next one goes */
+} undo_t;
+
 typedef struct y64sim {
     long_t pc;
-    mem_t *r;
+    long_t regs[REG_NONE];
     mem_t *m;
-    cc_t cc;
+    cc_t cc;            /* use get_cc(), stale while lcc.op >= 0 */
+    lazy_cc_t lcc;
+    tblock_t *tcache;   /* threaded code blocks, NULL until first used */
+    int tc_gen;         /* mem_t.code_gen the blocks were translated from */
+    jit_t *jit;         /* JIT state, NULL until first used */
+    prof_t *prof;       /* NULL unless profiling, forces nexti() */
+    pipe_t *pipe;       /* NULL unless timing the pipeline, forces nexti() */
+    bpsim_t *bp;        /* NULL unless simulating predictors, forces nexti() */
+    cache_t *caches;    /* NUM_CACHE levels, NULL unless simulating caches,
+                           forces nexti() */
+    trace_t *trace;     /* NULL unless tracing, forces nexti() */
+    undo_t *undo;       /* NULL unless keeping an undo log, forces nexti() */
+    FILE *out;          /* where fault messages go, NULL: nowhere */
+    /* set through the library (liby64.h) */
+    engine_t engine;    /* what y64_run() uses */
+    y64_mem_cb mem_cb;  /* NULL unless set, forces nexti() */
+    void *mem_arg;
+    y64_halt_cb halt_cb;
+    void *halt_arg;
+    long_t base_pc;     /* where y64_reset() goes back to */
+    long_t base_regs[REG_NONE];
+    cc_t base_cc;
+    byte_t *cov;        /* edge hit counts, NULL unless set, forces nexti() */
+    long_t cov_mask;
+    long_t cov_prev;    /* the previous PC, hashed */
 } y64sim_t;
 
+/* How to run an image (command line options) */
+typedef struct simopt {
+    engine_t engine;
+    long_t max_steps;
+    long_t memsize;
+    char *snapfile;     /* save the final state here, NULL: don't */
+    bool_t profile;     /* print an execution profile after the changes */
+    bool_t pipeline;    /* print PIPE cycles and stalls after the changes */
+    bool_t predictors;  /* print branch predictor misses after the changes */
+    bool_t caches;      /* print cache hits and misses after the changes */
+    int cache_cfg[NUM_CACHE][3];    /* s, E, b of each level */
+    char *tracefile;    /* write a memory trace here, NULL: don't */
+    bool_t trace_fetches;   /* with I lines for instruction fetches */
+    int rewind;         /* steps to take back after the run */
+    bool_t watch;       /* rewind to the last write of 'watch_addr' */
+    long_t watch_addr;
+    double time_limit;  /* stop after this many seconds, 0: never */
+    double progress;    /* seconds between progress reports, 0: none */
+} simopt_t;
+
+/*
+ * Snapshot file: SNAP_MAGIC, then little-endian 8-byte words memory length,
+ * pc, steps, status, cc and the registers, then the non-zero memory as runs of
+ * BLK_SIZE blocks (address, length, bytes), ended by a run of length 0.
+ */
+#define SNAP_MAGIC "Y64SNAP1"
+#define SNAP_MAGIC_LEN 8
+
+/* Batch mode: many images run by a fixed pool of worker threads */
+#define MAX_THREADS 64
+
+typedef struct job {
+    char *fname;    /* image.bin, results go to image.sim */
+    int loaded;     /* 0 if the image (or its .sim) couldn't be opened */
+    long_t steps;
+    long_t pc;
+    stat_t e;
+} job_t;
+
+typedef struct batch {
+    job_t *jobs;
+    int njobs;
+    int next;       /* first job not taken yet, protected by 'lock' */
+    pthread_mutex_t lock;
+    simopt_t *opt;
+} batch_t;
+
 #endif
 
@@ -0,0 +1,480 @@
+// y64test.c - Regression tests for the y64sim engines, through libY64.
+//
+// Every test builds a small image, runs it on the engine under test and
+// compares the result with the reference interpreter (Y64_INTERP).
+// test_time_limit and test_cache_trace run ./y64sim itself, so they need the
+// built simulator; test_cache_trace also runs csim-ref from the cache lab.
+//
+// Usage: ./y64test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liby64.h"
+
+#define MEM_SIZE (1 << 13)
+#define TEST_STEPS 100000
+
+/* y64sim's default max_steps, which -L alone must not stop at */
+#define DEFAULT_STEPS 10000
+#define LOOP_FILE "y64test_loop.bin"
+
+#define CSIM_REF "../lab8-cachelab/csim-ref"
+#define SPAN_FILE "y64test_span.bin"
+#define TRACE_FILE "y64test_span.trace"
+
+/* the slot of PC -1 in the block caches (TB_CACHE_SIZE/JIT_CACHE_SIZE - 1) */
+#define LAST_SLOT 1023
+
+/*
+ * A tiny Y64 encoder, enough for the test images
+ */
+typedef struct image
+{
+    unsigned char buf[MEM_SIZE];
+    int pos;
+} image_t;
+
+static void put_byte(image_t *img, int b)
+{
+    img->buf[img->pos++] = (unsigned char)b;
+}
+
+static void put_quad(image_t *img, int64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        put_byte(img, (int)((uint64_t)v >> (8 * i)) & 0xFF);
+}
+
+static void halt(image_t *img) { put_byte(img, 0x00); }
+static void ret(image_t *img) { put_byte(img, 0x90); }
+
+static void irmovq(image_t *img, int64_t v, int rB)
+{
+    put_byte(img, 0x30);
+    put_byte(img, 0xF0 | rB);
+    put_quad(img, v);
+}
+
+static void rmmovq(image_t *img, int rA, int64_t d, int rB)
+{
+    put_byte(img, 0x40);
+    put_byte(img, rA << 4 | rB);
+    put_quad(img, d);
+}
+
+static void mrmovq(image_t *img, int64_t d, int rB, int rA)
+{
+    put_byte(img, 0x50);
+    put_byte(img, rA << 4 | rB);
+    put_quad(img, d);
+}
+
+static void addq(image_t *img, int rA, int rB)
+{
+    put_byte(img, 0x60);
+    put_byte(img, rA << 4 | rB);
+}
+
+static void jump(image_t *img, int ifun, int64_t dest)
+{
+    put_byte(img, 0x70 | ifun);
+    put_quad(img, dest);
+}
+
+static void call(image_t *img, int64_t dest)
+{
+    put_byte(img, 0x80);
+    put_quad(img, dest);
+}
+
+static void pushq(image_t *img, int rA)
+{
+    put_byte(img, 0xA0);
+    put_byte(img, rA << 4 | 0xF);
+}
+
+static void popq(image_t *img, int rA)
+{
+    put_byte(img, 0xB0);
+    put_byte(img, rA << 4 | 0xF);
+}
+
+/* write_image: write the code of 'img' to 'fname' as a .bin, 0 on error */
+static int write_image(image_t *img, const char *fname)
+{
+    FILE *f = fopen(fname, "wb");
+
+    if (!f)
+        return 0;
+    if (fwrite(img->buf, 1, img->pos, f) != img->pos)
+    {
+        fclose(f);
+        return 0;
+    }
+    return !fclose(f);
+}
+
+/* the state a run ends in */
+typedef struct result
+{
+    int status;
+    int steps;
+    int64_t pc;
+    int64_t regs[Y64_NREGS];
+    int cc;
+} result_t;
+
+static void get_result(y64_t *y, int status, int steps, result_t *r)
+{
+    int i;
+
+    r->status = status;
+    r->steps = steps;
+    r->pc = y64_get_pc(y);
+    for (i = 0; i < Y64_NREGS; i++)
+        r->regs[i] = y64_get_reg(y, i);
+    r->cc = y64_get_cc(y);
+}
+
+/* run_image: load and run 'img' on 'engine' from PC 0 */
+static void run_image(image_t *img, int engine, result_t *r)
+{
+    y64_t *y = y64_create(MEM_SIZE);
+    int status, steps;
+
+    y64_set_engine(y, engine);
+    y64_load(y, img->buf, sizeof(img->buf));
+    status = y64_run(y, TEST_STEPS, &steps);
+    get_result(y, status, steps, r);
+    y64_destroy(y);
+}
+
+static const char *engine_name[] = {"interp", "threaded", "jit"};
+
+/* same_result: compare 'r' with the interpreter's 'ref', printing any difference */
+static int same_result(const char *test, int engine, result_t *ref, result_t *r)
+{
+    int i;
+
+    if (r->status != ref->status || r->steps != ref->steps || r->pc != ref->pc ||
+        r->cc != ref->cc)
+    {
+        printf("%s (%s): status %s, %d steps, PC 0x%lx, cc %d; expected %s, %d steps, "
+               "PC 0x%lx, cc %d\n",
+               test, engine_name[engine], y64_status_name(r->status), r->steps, (long)r->pc,
+               r->cc, y64_status_name(ref->status), ref->steps, (long)ref->pc, ref->cc);
+        return 0;
+    }
+    for (i = 0; i < Y64_NREGS; i++)
+        if (r->regs[i] != ref->regs[i])
+        {
+            printf("%s (%s): register %d is 0x%lx, expected 0x%lx\n", test, engine_name[engine],
+                   i, (long)r->regs[i], (long)ref->regs[i]);
+            return 0;
+        }
+    return 1;
+}
+
+/*
+ * A block is translated at LAST_SLOT (and called often enough to be hot),
+ * then a store over code flushes the block caches, then 'ret' goes to
+ * PC -1. That is the PC that marks an empty slot, so it must not run the
+ * stale block left there: the interpreter stops with ADR at PC -1.
+ */
+static void pc_minus_one_image(image_t *img)
+{
+    memset(img, 0, sizeof(*img));
+    irmovq(img, 0x1800, Y64_RSP);
+    irmovq(img, 20, Y64_RSI);
+    irmovq(img, -1, Y64_RDI);
+    /* loop: */
+    call(img, LAST_SLOT);
+    addq(img, Y64_RDI, Y64_RSI);
+    jump(img, 4, 30); /* jne loop */
+    irmovq(img, 0, Y64_RCX);
+    rmmovq(img, Y64_RCX, 0, Y64_RCX); /* over the code at 0 */
+    irmovq(img, -1, Y64_RBX);
+    pushq(img, Y64_RBX);
+    ret(img);
+
+    img->pos = LAST_SLOT;
+    addq(img, Y64_RDX, Y64_RAX);
+    ret(img);
+}
+
+static int test_pc_minus_one(int engine)
+{
+    image_t img;
+    result_t ref, r;
+
+    pc_minus_one_image(&img);
+    run_image(&img, Y64_INTERP, &ref);
+    run_image(&img, engine, &r);
+    return same_result("pc_minus_one", engine, &ref, &r);
+}
+
+/*
+ * Code changed between two runs (here by y64_write(), the fuzzer does it
+ * with y64_reset()) must be translated again: the second run has to see
+ * the new immediate.
+ */
+static void run_rewritten(int engine, result_t *r)
+{
+    y64_t *y = y64_create(MEM_SIZE);
+    image_t img;
+    unsigned char imm = 2;
+    int status, steps;
+
+    memset(&img, 0, sizeof(img));
+    irmovq(&img, 1, Y64_RAX);
+    halt(&img);
+
+    y64_set_engine(y, engine);
+    y64_load(y, img.buf, img.pos);
+    y64_run(y, TEST_STEPS, &steps);
+    y64_write(y, 2, &imm, 1); /* irmovq $2, %rax */
+    y64_set_pc(y, 0);
+    status = y64_run(y, TEST_STEPS, &steps);
+    get_result(y, status, steps, r);
+    y64_destroy(y);
+}
+
+static int test_code_changed_between_runs(int engine)
+{
+    result_t ref, r;
+
+    run_rewritten(Y64_INTERP, &ref);
+    run_rewritten(engine, &r);
+    return same_result("code_changed_between_runs", engine, &ref, &r);
+}
+
+/* a loop storing a countdown from 1000 to 0x1000, hot enough for the JIT */
+static void store_loop_image(image_t *img)
+{
+    memset(img, 0, sizeof(*img));
+    irmovq(img, 0x1000, Y64_RBX);
+    irmovq(img, 1000, Y64_RSI);
+    irmovq(img, -1, Y64_RDI);
+    /* loop: */
+    rmmovq(img, Y64_RSI, 0, Y64_RBX);
+    addq(img, Y64_RDI, Y64_RSI);
+    jump(img, 4, 30); /* jne loop */
+    halt(img);
+}
+
+/* stores compiled while memory isn't tracked (no y64_snapshot()) */
+static int test_untracked_store(int engine)
+{
+    image_t img;
+    result_t ref, r;
+
+    store_loop_image(&img);
+    run_image(&img, Y64_INTERP, &ref);
+    run_image(&img, engine, &r);
+    return same_result("untracked_store", engine, &ref, &r);
+}
+
+/*
+ * y64_snapshot() after the loop is compiled: from then on its stores must
+ * save the blocks they dirty, so y64_reset() brings the snapshot back.
+ */
+static int test_snapshot_after_compile(int engine)
+{
+    y64_t *y = y64_create(MEM_SIZE);
+    static unsigned char before[MEM_SIZE], after[MEM_SIZE];
+    image_t img;
+    int steps, ok;
+
+    store_loop_image(&img);
+    y64_set_engine(y, engine);
+    y64_load(y, img.buf, img.pos);
+    y64_run(y, 300, &steps);
+    y64_snapshot(y);
+    y64_read(y, 0, before, MEM_SIZE);
+    y64_run(y, TEST_STEPS, &steps);
+    y64_reset(y);
+    y64_read(y, 0, after, MEM_SIZE);
+    y64_destroy(y);
+
+    ok = !memcmp(before, after, MEM_SIZE);
+    if (!ok)
+        printf("snapshot_after_compile (%s): memory differs after y64_reset()\n",
+               engine_name[engine]);
+    return ok;
+}
+
+/*
+ * './y64sim -L' with no max_steps has no step budget: an endless loop runs
+ * well past the default max_steps and only the time limit stops it.
+ */
+static int test_time_limit(int engine)
+{
+    image_t img;
+    FILE *f;
+    char cmd[256], line[256];
+    long steps = -1;
+    int timed_out = 0;
+
+    memset(&img, 0, sizeof(img));
+    jump(&img, 0, 0); /* jmp 0 */
+    if (!write_image(&img, LOOP_FILE))
+    {
+        printf("time_limit (%s): can't write %s\n", engine_name[engine], LOOP_FILE);
+        return 0;
+    }
+
+    snprintf(cmd, sizeof(cmd), "./y64sim -e %s -L 0.2 %s 2>&1", engine_name[engine],
+             LOOP_FILE);
+    f = popen(cmd, "r");
+    if (!f)
+    {
+        remove(LOOP_FILE);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (!strncmp(line, "Time limit of", 13))
+            timed_out = 1;
+        sscanf(line, "Stopped in %ld steps", &steps);
+    }
+    pclose(f);
+    remove(LOOP_FILE);
+
+    if (!timed_out || steps <= DEFAULT_STEPS)
+    {
+        printf("time_limit (%s): %s after %ld steps, expected the time limit after more "
+               "than %d\n",
+               engine_name[engine], timed_out ? "timed out" : "stopped", steps,
+               DEFAULT_STEPS);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Loads and stores that span a 16-byte block boundary, at addresses that
+ * keep evicting each other in a 16-set, 2-way cache: rmmovq/mrmovq at
+ * 0x100c + 0x40 * i, a push at 0x1fec and a store at 0x101c + 0x40 * i.
+ */
+#define SPAN_FUNC 0x200
+
+static void span_image(image_t *img)
+{
+    int loop;
+
+    memset(img, 0, sizeof(*img));
+    irmovq(img, 0x1ff4, Y64_RSP);
+    irmovq(img, 0x100c, Y64_RBP);
+    irmovq(img, 40, Y64_RSI);
+    irmovq(img, -1, Y64_RDI);
+    irmovq(img, 0x40, Y64_R8);
+    loop = img->pos;
+    rmmovq(img, Y64_RSI, 0, Y64_RBP);
+    mrmovq(img, 0, Y64_RBP, Y64_RBX);
+    call(img, SPAN_FUNC);
+    addq(img, Y64_R8, Y64_RBP);
+    addq(img, Y64_RDI, Y64_RSI);
+    jump(img, 4, loop); /* jne loop */
+    halt(img);
+
+    img->pos = SPAN_FUNC;
+    pushq(img, Y64_RBX);
+    popq(img, Y64_RBX);
+    rmmovq(img, Y64_RSI, 0x10, Y64_RBP);
+    ret(img);
+}
+
+/*
+ * the L1D counts of './y64sim -c' must be what csim-ref reports for the
+ * trace './y64sim -T' writes of the same run, block-spanning accesses too
+ */
+static int test_cache_trace(int engine)
+{
+    image_t img;
+    FILE *f;
+    char cmd[256], line[256];
+    long model[3] = {-1, -1, -1}, csim[3] = {-2, -2, -2};
+    char *p;
+
+    span_image(&img);
+    if (!write_image(&img, SPAN_FILE))
+    {
+        printf("cache_trace (%s): can't write %s\n", engine_name[engine], SPAN_FILE);
+        return 0;
+    }
+
+    snprintf(cmd, sizeof(cmd), "./y64sim -e %s -c l1d=4:2:4 -T %s %s 2>&1",
+             engine_name[engine], TRACE_FILE, SPAN_FILE);
+    if ((f = popen(cmd, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), f))
+            if (strstr(line, "L1D") && (p = strstr(line, "hits:")) != NULL)
+                sscanf(p, "hits:%ld misses:%ld evictions:%ld", &model[0], &model[1],
+                       &model[2]);
+        pclose(f);
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s -s 4 -E 2 -b 4 -t %s 2>&1", CSIM_REF, TRACE_FILE);
+    if ((f = popen(cmd, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), f))
+            sscanf(line, "hits:%ld misses:%ld evictions:%ld", &csim[0], &csim[1], &csim[2]);
+        pclose(f);
+    }
+    remove(SPAN_FILE);
+    remove(TRACE_FILE);
+    remove(".csim_results"); /* csim-ref's printSummary() leaves it */
+
+    if (memcmp(model, csim, sizeof(model)))
+    {
+        printf("cache_trace (%s): -c hits:%ld misses:%ld evictions:%ld, csim-ref on -T "
+               "hits:%ld misses:%ld evictions:%ld\n",
+               engine_name[engine], model[0], model[1], model[2], csim[0], csim[1], csim[2]);
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct test
+{
+    const char *name;
+    int (*fn)(int engine);
+    int engine;
+} test_t;
+
+static test_t tests[] = {
+    {"pc_minus_one", test_pc_minus_one, Y64_THREADED},
+    {"pc_minus_one", test_pc_minus_one, Y64_JIT},
+    {"code_changed_between_runs", test_code_changed_between_runs, Y64_THREADED},
+    {"code_changed_between_runs", test_code_changed_between_runs, Y64_JIT},
+    {"untracked_store", test_untracked_store, Y64_THREADED},
+    {"untracked_store", test_untracked_store, Y64_JIT},
+    {"snapshot_after_compile", test_snapshot_after_compile, Y64_THREADED},
+    {"snapshot_after_compile", test_snapshot_after_compile, Y64_JIT},
+    {"time_limit", test_time_limit, Y64_INTERP},
+    {"time_limit", test_time_limit, Y64_THREADED},
+    {"time_limit", test_time_limit, Y64_JIT},
+    {"cache_trace", test_cache_trace, Y64_INTERP},
+    {NULL, NULL, 0}};
+
+int main(int argc, char *argv[])
+{
+    int i, failed = 0;
+
+    for (i = 0; tests[i].name; i++)
+    {
+        int ok;
+
+        /* the name goes out first, in case the test crashes the simulator */
+        printf("%-26s %-9s ", tests[i].name, engine_name[tests[i].engine]);
+        fflush(stdout);
+        ok = tests[i].fn(tests[i].engine);
+        printf("%s\n", ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    printf("%d of %d tests failed\n", failed, i);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+// asmbench.c - Benchmark for the y64 assembler on a large synthetic program.
+//
+// Writes bench.ys (1M lines unless told otherwise): code with a label every
+// few lines, forward and backward jumps and calls, immediates and data that
+// name labels, comments and alignment. Then times ./y64asm on it.
+//
+// Usage: ./asmbench [lines] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_FILE "bench.ys"
+
+/* the lines of one block, each block defines one label */
+#define BLOCK_LINES 10
+
+static int gen_bench(const char *fname, int lines)
+{
+    FILE *out = fopen(fname, "w");
+    int nblocks = lines / BLOCK_LINES;
+    int i;
+
+    if (!out)
+        return -1;
+
+    fprintf(out, "# synthetic y64 program for asmbench, %d blocks\n", nblocks);
+    fprintf(out, "\t.pos 0\n");
+    for (i = 0; i < nblocks; i++)
+    {
+        int fwd = i + 1 < nblocks ? i + 1 : 0;
+        int back = i / 2;
+
+        fprintf(out, "L%07d:\tirmovq $%d, %%rax\n", i, i);
+        fprintf(out, "\taddq %%rax, %%rbx\n");
+        fprintf(out, "\tmrmovq 8(%%rbp), %%rcx   # load\n");
+        fprintf(out, "\trmmovq %%rcx, 16(%%rsp)\n");
+        fprintf(out, "\tjle L%07d\n", fwd);
+        fprintf(out, "\tcall L%07d\n", back);
+        fprintf(out, "\tirmovq D%07d, %%rdx\n", i);
+        fprintf(out, "# block %d\n", i);
+        fprintf(out, "\t.align 8\n");
+        fprintf(out, "D%07d:\t.quad L%07d\n", i, fwd);
+    }
+    fprintf(out, "\thalt\n");
+
+    fclose(out);
+    return nblocks * BLOCK_LINES + 3;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int lines = argc > 1 ? atoi(argv[1]) : 1000000;
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+    double *secs;
+    double t;
+    int i;
+
+    if (lines < 1 || runs < 1)
+    {
+        printf("Usage: %s [lines] [runs]\n", argv[0]);
+        return 1;
+    }
+
+    lines = gen_bench(BENCH_FILE, lines);
+    if (lines < 0)
+    {
+        printf("Can't write %s\n", BENCH_FILE);
+        return 1;
+    }
+
+    secs = (double *)malloc(runs * sizeof(double));
+    for (i = 0; i < runs; i++)
+    {
+        t = now_secs();
+        if (system("./y64asm " BENCH_FILE))
+        {
+            printf("./y64asm failed on %s\n", BENCH_FILE);
+            return 1;
+        }
+        secs[i] = now_secs() - t;
+        printf("Run %d: %d lines in %.3fs\n", i + 1, lines, secs[i]);
+    }
+
+    qsort(secs, runs, sizeof(double), cmp_double);
+    t = secs[runs / 2];
+    printf("Median of %d runs: %.3fs, %.0f lines/s\n", runs, t, lines / t);
+    free(secs);
+    return 0;
+}
@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "y64asm.h"
 
@@ -24,6 +28,66 @@ int lineno = 0;
 
 int64_t vmaddr = 0; /* vm addr */
 
+/*
+ * arena: everything that lives until finit() (lines, symbols, relocations
+ * and names) is bumped out of big zeroed blocks and freed with them at once
+ */
+arena_blk_t *arena = NULL;
+
+#define ARENA_BLKSIZE (1 << 20)
+
+/*
+ * arena_alloc: allocate 'size' zeroed bytes from the arena
+ *
+ * return
+ *     the bytes (8-byte aligned), it exits if out of memory
+ */
+void *arena_alloc(size_t size)
+{
+    arena_blk_t *blk = arena;
+    size_t bsize;
+    void *p;
+
+    size = (size + 7) & ~(size_t)7;
+    if (!blk || blk->size - blk->used < size)
+    {
+        /* big requests get a block of their own behind the current one */
+        bsize = size > ARENA_BLKSIZE / 4 ? size : ARENA_BLKSIZE;
+        blk = (arena_blk_t *)calloc(1, sizeof(arena_blk_t) + bsize);
+        if (!blk)
+        {
+            err_print("Out of memory");
+            exit(1);
+        }
+        blk->size = bsize;
+        if (bsize != ARENA_BLKSIZE && arena)
+        {
+            blk->next = arena->next;
+            arena->next = blk;
+        }
+        else
+        {
+            blk->next = arena;
+            arena = blk;
+        }
+    }
+    p = blk->data + blk->used;
+    blk->used += size;
+    return p;
+}
+
+/* arena_free: free every block of the arena */
+void arena_free(void)
+{
+    arena_blk_t *next;
+    while (arena)
+    {
+        next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
 /* register table */
 const reg_t reg_table[REG_NONE] = {
     {"%rax", REG_RAX, 4},
@@ -41,12 +105,32 @@ const reg_t reg_table[REG_NONE] = {
     {"%r12", REG_R12, 4},
     {"%r13", REG_R13, 4},
     {"%r14", REG_R14, 4}};
-const reg_t *find_register(char *name)
+
+/*
+ * hash_token: hash the 'len' bytes of a token into 'bits' bits. With the
+ * multipliers below it is perfect over the register names and over the
+ * mnemonics (init() checks it), so a lookup is one probe plus an exact
+ * compare and the order of the tables doesn't matter.
+ */
+static unsigned hash_token(char *name, int len, unsigned mult, int bits)
 {
+    unsigned h = 0;
     int i;
-    for (i = 0; i < REG_NONE; i++)
-        if (!strncmp(name, reg_table[i].name, reg_table[i].namelen))
-            return &reg_table[i];
+    for (i = 0; i < len; i++)
+        h = h * mult + (byte_t)name[i];
+    return (h * 0x9E3779B1u) >> (32 - bits);
+}
+
+#define REG_HASH_MULT 16
+#define REG_HASH_BITS 5
+const reg_t *reg_hash[1 << REG_HASH_BITS];
+
+/* find_register: the register named exactly by the 'len' bytes of 'name' */
+const reg_t *find_register(char *name, int len)
+{
+    const reg_t *reg = reg_hash[hash_token(name, len, REG_HASH_MULT, REG_HASH_BITS)];
+    if (reg && reg->namelen == len && !memcmp(reg->name, name, len))
+        return reg;
     return NULL;
 }
 
@@ -88,39 +172,112 @@ instr_t instr_set[] = {
     {NULL, 1, 0, 0} // end
 };
 
-instr_t *find_instr(char *name)
+#define INSTR_HASH_MULT 43
+#define INSTR_HASH_BITS 7
+instr_t *instr_hash[1 << INSTR_HASH_BITS];
+
+/* find_instr: the instruction named exactly by the 'len' bytes of 'name' */
+instr_t *find_instr(char *name, int len)
 {
+    instr_t *inst = instr_hash[hash_token(name, len, INSTR_HASH_MULT, INSTR_HASH_BITS)];
+    if (inst && inst->len == len && !memcmp(inst->name, name, len))
+        return inst;
+    return NULL;
+}
+
+/*
+ * symbol table (don't forget to init and finit it): open addressing with
+ * linear probing over 'symcap' slots (a power of two), never more than half
+ * full. Every name gets one symbol_t, created by its first label or use.
+ */
+symbol_t **symtab = NULL;
+int symcap = 0;
+int symcnt = 0;
+
+#define SYMTAB_INIT 1024
+
+/* hash_name: FNV-1a hash of the 'len' bytes of 'name' */
+static unsigned hash_name(char *name, int len)
+{
+    unsigned h = 2166136261u;
     int i;
-    // printf(">>> checking instr '%s' \n", name);
-    for (i = 0; instr_set[i].name; i++)
-        if (strncmp(instr_set[i].name, name, instr_set[i].len) == 0)
-            return &instr_set[i];
+    for (i = 0; i < len; i++)
+        h = (h ^ (byte_t)name[i]) * 16777619u;
+    return h;
+}
 
-    return NULL;
+/* probe_symbol: the slot holding 'name', or the empty one it would go in */
+static symbol_t **probe_symbol(char *name, int len, unsigned hash)
+{
+    unsigned i = hash & (symcap - 1);
+    symbol_t *p;
+    while ((p = symtab[i]) != NULL)
+    {
+        if (p->hash == hash && p->len == len && !memcmp(p->name, name, len))
+            break;
+        i = (i + 1) & (symcap - 1);
+    }
+    return &symtab[i];
 }
 
-/* symbol table (don't forget to init and finit it) */
-symbol_t *symtab = NULL;
+/* grow_symtab: double the table, moving every symbol to its new slot */
+static void grow_symtab(void)
+{
+    symbol_t **old = symtab;
+    int oldcap = symcap;
+    int i;
+
+    symcap *= 2;
+    symtab = (symbol_t **)calloc(symcap, sizeof(symbol_t *)); // free in finit
+    for (i = 0; i < oldcap; i++)
+        if (old[i])
+            *probe_symbol(old[i]->name, old[i]->len, old[i]->hash) = old[i];
+    free(old);
+}
 
 /*
- * find_symbol: scan table to find the symbol
+ * intern_symbol: find the symbol, adding it (undefined) if it's new
+ * args
+ *     name: the name of symbol (in the arena, a new symbol keeps it)
+ *
+ * return
+ *     symbol_t: the 'name' symbol
+ */
+symbol_t *intern_symbol(char *name)
+{
+    int len = strlen(name);
+    unsigned hash = hash_name(name, len);
+    symbol_t **slot = probe_symbol(name, len, hash);
+
+    if (*slot)
+        return *slot;
+
+    /* create new symbol_t */
+    symbol_t *newsym = (symbol_t *)arena_alloc(sizeof(symbol_t));
+    newsym->name = name;
+    newsym->len = len;
+    newsym->hash = hash;
+    *slot = newsym;
+
+    if (++symcnt * 2 > symcap)
+        grow_symtab();
+    return newsym;
+}
+
+/*
+ * find_symbol: look the symbol up in the table
  * args
  *     name: the name of symbol
  *
  * return
  *     symbol_t: the 'name' symbol
- *     NULL: not exist
+ *     NULL: not exist (or not defined yet)
  */
 symbol_t *find_symbol(char *name)
 {
-    symbol_t *p = symtab->next;
-    while (p)
-    {
-        if (!strncmp(p->name, name, p->len))
-            return p;
-        p = p->next;
-    }
-    return NULL;
+    int len = strlen(name);
+    symbol_t *p = *probe_symbol(name, len, hash_name(name, len));
+    return p && p->defined ? p : NULL;
 }
 
 /*
@@ -134,27 +291,19 @@ symbol_t *find_symbol(char *name)
  */
 int add_symbol(char *name)
 {
+    symbol_t *sym = intern_symbol(name);
+
     /* check duplicate */
-    if (find_symbol(name))
+    if (sym->defined)
         return -1;
-    /* create new symbol_t (don't forget to free it)*/
-    symbol_t *newsym = (symbol_t *)malloc(sizeof(symbol_t));
-    memset(newsym, 0, sizeof(newsym));
-    newsym->name = (char *)malloc(strlen(name) + 1);
-    strcpy(newsym->name, name);
-    newsym->addr = vmaddr;
-    newsym->len = strlen(name);
-
-    /* add the new symbol_t to symbol table */
-    symbol_t *p = symtab;
-    while (p->next)
-        p = p->next;
-    p->next = newsym;
+    sym->defined = TRUE;
+    sym->addr = vmaddr;
     return 0;
 }
 
-/* relocation table (don't forget to init and finit it) */
+/* relocation table (don't forget to init and finit it), 'reltail' is its last entry */
 reloc_t *reltab = NULL;
+reloc_t *reltail = NULL;
 
 /*
  * add_reloc: add a new relocation to the relocation table
@@ -163,19 +312,14 @@ reloc_t *reltab = NULL;
  */
 void add_reloc(char *name, bin_t *bin)
 {
-    /* create new reloc_t (don't forget to free it)*/
-    reloc_t *newrel = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
-    memset(newrel, 0, sizeof(reloc_t));
+    /* create new reloc_t */
+    reloc_t *newrel = (reloc_t *)arena_alloc(sizeof(reloc_t));
     newrel->y64bin = bin;
-
-    newrel->name = (char *)malloc(strlen(name) + 1);
-    strcpy(newrel->name, name);
+    newrel->symbol = intern_symbol(name);
 
     /* add the new reloc_t to relocation table */
-    reloc_t *p = reltab;
-    while (p->next)
-        p = p->next;
-    p->next = newrel;
+    reltail->next = newrel;
+    reltail = newrel;
 }
 
 /* macro for parsing y64 assembly code */
@@ -186,7 +330,8 @@ void add_reloc(char *name, bin_t *bin)
 #define IS_IMM(s) (*(s) == '$')
 
 #define IS_BLANK(s) (*(s) == ' ' || *(s) == '\t')
-#define IS_END(s) (*(s) == '\0')
+/* lines are slices of the input, each one ends at its newline (or CR) */
+#define IS_END(s) (*(s) == '\0' || *(s) == '\n' || *(s) == '\r')
 
 #define SKIP_BLANK(s)                     \
     do                                    \
@@ -224,9 +369,13 @@ parse_t parse_instr(char **ptr, instr_t **inst)
     /* skip the blank */
     SKIP_BLANK(*ptr);
 
-    /* find_instr and check end */
-    instr_t *nowins = find_instr(*ptr);
-    if (nowins && (IS_BLANK(*ptr + nowins->len) || IS_END(*ptr + nowins->len)))
+    /* the token runs to the next blank or end */
+    int len = 0;
+    while (!IS_END(*ptr + len) && !IS_BLANK(*ptr + len))
+        len++;
+
+    instr_t *nowins = find_instr(*ptr, len);
+    if (nowins)
     {
         /* set 'ptr' and 'inst' */
         (*ptr) += nowins->len;
@@ -277,8 +426,12 @@ parse_t parse_reg(char **ptr, regid_t *regid)
     if (!IS_REG(*ptr))
         return PARSE_ERR;
 
-    /* find register */
-    reg_t *tmp = find_register(*ptr);
+    /* find register, the token is '%' and the letters and digits after it */
+    int len = 1;
+    while (IS_LETTER(*ptr + len) || (*(*ptr + len) >= '0' && *(*ptr + len) <= '9'))
+        len++;
+
+    const reg_t *tmp = find_register(*ptr, len);
     if (tmp)
     {
         /* set 'ptr' and 'regid' */
@@ -312,9 +465,9 @@ parse_t parse_symbol(char **ptr, char **name)
         len++;
 
     /* allocate name and copy to it */
-    *name = (char *)malloc(len + 1);
-    memset(*name, 0, sizeof(*name));
-    strncpy(*name, *ptr, len);
+    *name = (char *)arena_alloc(len + 1);
+    memcpy(*name, *ptr, len);
+    (*name)[len] = '\0';
 
     /* set 'ptr' and 'name' */
     (*ptr) += len;
@@ -374,9 +527,18 @@ parse_t parse_imm(char **ptr, char **name, long *value)
     /* if IS_IMM, then parse the digit */
     if (IS_IMM(*ptr))
     {
-        char *endptr;
+        char *endptr, *digit;
         (*ptr)++;
-        (*value) = strtoul(*ptr, &endptr, 0);
+        /* strtoul() would skip newlines too, stop it at the end of the line */
+        digit = *ptr;
+        SKIP_BLANK(digit);
+        if (IS_END(digit))
+        {
+            (*value) = 0;
+            endptr = *ptr;
+        }
+        else
+            (*value) = strtoul(*ptr, &endptr, 0);
         // printf(">>> Immediate parsed: $%d\n", *value);
         *ptr = endptr;
         if (IS_BLANK(*ptr) || **ptr == ',' || IS_END(*ptr))
@@ -388,9 +550,9 @@ parse_t parse_imm(char **ptr, char **name, long *value)
         int len = 0;
         while (IS_LETTER(*ptr + len) || IS_DIGIT(*ptr + len))
             len++;
-        *name = (char *)malloc(len + 1);
-        memset(*name, 0, sizeof(*name));
-        strncpy(*name, *ptr, len);
+        *name = (char *)arena_alloc(len + 1);
+        memcpy(*name, *ptr, len);
+        (*name)[len] = '\0';
         (*ptr) += len;
         return PARSE_SYMBOL;
     }
@@ -477,9 +639,9 @@ parse_t parse_data(char **ptr, char **name, long *value)
         int len = 0;
         while (IS_LETTER(*ptr + len) || IS_DIGIT(*ptr + len))
             len++;
-        *name = (char *)malloc(len + 1);
-        memset(*name, 0, sizeof(*name));
-        strncpy(*name, *ptr, len);
+        *name = (char *)arena_alloc(len + 1);
+        memcpy(*name, *ptr, len);
+        (*name)[len] = '\0';
         // printf(">>> symbol parsed: %s\n", *name);
         (*ptr) += len;
         return PARSE_SYMBOL;
@@ -513,9 +675,9 @@ parse_t parse_label(char **ptr, char **name)
     if (*(*ptr + len) == ':')
     {
         /* allocate name and copy to it */
-        *name = (char *)malloc(len + 1);
-        memset(*name, 0, sizeof(*name));
-        strncpy(*name, *ptr, len);
+        *name = (char *)arena_alloc(len + 1);
+        memcpy(*name, *ptr, len);
+        (*name)[len] = '\0';
         /* set 'ptr' and 'name' */
         (*ptr) += len + 1;
         return PARSE_LABEL;
@@ -578,9 +740,6 @@ type_t parse_line(line_t *line)
             return TYPE_ERR;
         }
         // printf(">>> Label parsed: %s\n", label);
-
-        if (label)
-            free(label);
     }
     SKIP_BLANK(asmptr);
     if (IS_END(asmptr) || IS_COMMENT(asmptr))
@@ -670,7 +829,6 @@ type_t parse_line(line_t *line)
         {
             // await relocating
             add_reloc(symbol, &line->y64bin);
-            free(symbol);
         }
         binptr += 8;
         break;
@@ -750,7 +908,6 @@ type_t parse_line(line_t *line)
             if (parse_result == PARSE_SYMBOL)
             {
                 err_print(".align symbol??? F**k you!");
-                free(symbol);
                 return TYPE_ERR;
             }
             // not quite sure
@@ -770,7 +927,6 @@ type_t parse_line(line_t *line)
             if (parse_result == PARSE_SYMBOL)
             {
                 err_print(".pos symbol??? F**k you!");
-                free(symbol);
                 return TYPE_ERR;
             }
             newvmaddr = value;
@@ -786,7 +942,6 @@ type_t parse_line(line_t *line)
             else if (parse_result == PARSE_SYMBOL)
             {
                 add_reloc(symbol, &line->y64bin);
-                free(symbol);
             }
             break;
         }
@@ -809,6 +964,74 @@ type_t parse_line(line_t *line)
     return TYPE_INS;
 }
 
+/* the whole input, the text of every line_t points into it (freed in finit) */
+char *asm_text = NULL;
+size_t asm_len = 0;
+bool_t asm_mapped = FALSE; /* mapped file rather than a malloc'd buffer */
+
+/*
+ * read_input: read all of 'in' into one '\0'-terminated buffer, for input
+ *     that can't be mapped (e.g., stdin or a pipe)
+ * args
+ *     in: point to input file
+ *     len: point to the length of the input
+ *
+ * return
+ *     the buffer
+ *     NULL: error, it can't be read
+ */
+char *read_input(FILE *in, size_t *len)
+{
+    size_t size = 1 << 16, n = 0, got;
+    char *buf = (char *)malloc(size + 1), *tmp;
+
+    while (buf && (got = fread(buf + n, 1, size - n, in)) > 0)
+    {
+        n += got;
+        if (n == size)
+        {
+            size *= 2;
+            tmp = (char *)realloc(buf, size + 1);
+            if (!tmp)
+                free(buf);
+            buf = tmp;
+        }
+    }
+    if (!buf || ferror(in))
+    {
+        free(buf);
+        return NULL;
+    }
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+/*
+ * map_input: map a regular file read-only
+ * args
+ *     in: point to input file
+ *     len: point to the length of the input
+ *
+ * return
+ *     the mapping
+ *     NULL: it isn't a regular file or can't be mapped
+ */
+char *map_input(FILE *in, size_t *len)
+{
+    struct stat st;
+    void *p;
+
+    if (fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size;
+    return (char *)p;
+}
+
 /*
  * assemble: assemble an y64 file (e.g., 'asum.ys')
  * args
@@ -820,29 +1043,42 @@ type_t parse_line(line_t *line)
  */
 int assemble(FILE *in)
 {
-    static char asm_buf[MAX_INSLEN]; /* the current line of asm code */
     line_t *line;
-    int slen;
-    char *y64asm;
+    char *y64asm, *end, *eol, *next;
 
-    /* read y64 code line-by-line, and parse them to generate raw y64 binary code list */
-    while (fgets(asm_buf, MAX_INSLEN, in) != NULL)
+    asm_text = map_input(in, &asm_len);
+    asm_mapped = asm_text != NULL;
+    if (!asm_mapped)
+        asm_text = read_input(in, &asm_len);
+    if (!asm_text)
     {
-        slen = strlen(asm_buf);
-        while ((asm_buf[slen - 1] == '\n') || (asm_buf[slen - 1] == '\r'))
+        err_print("Can't read input");
+        return -1;
+    }
+
+    /* parse the input line by line in place, to generate raw y64 binary code list */
+    end = asm_text + asm_len;
+    for (y64asm = asm_text; y64asm < end; y64asm = next)
+    {
+        eol = (char *)memchr(y64asm, '\n', end - y64asm);
+        next = eol ? eol + 1 : end;
+        if (!eol && asm_mapped)
         {
-            asm_buf[--slen] = '\0'; /* replace terminator */
+            /* nothing ends the last line of a mapping, parse a terminated copy */
+            char *copy = (char *)arena_alloc(end - y64asm + 1);
+            memcpy(copy, y64asm, end - y64asm);
+            eol = copy + (end - y64asm);
+            y64asm = copy;
         }
+        else if (!eol)
+            eol = end;
+        while (eol > y64asm && eol[-1] == '\r')
+            eol--;
 
-        /* store y64 assembly code */
-        y64asm = (char *)malloc(sizeof(char) * (slen + 1)); // free in finit
-        strcpy(y64asm, asm_buf);
-
-        line = (line_t *)malloc(sizeof(line_t)); // free in finit
-        memset(line, '\0', sizeof(line_t));
-
+        line = (line_t *)arena_alloc(sizeof(line_t));
         line->type = TYPE_COMM;
         line->y64asm = y64asm;
+        line->len = eol - y64asm;
         line->next = NULL;
 
         line_tail->next = line;
@@ -873,10 +1109,10 @@ int relocate(void)
     while (rtmp)
     {
         /* find symbol */
-        symbol_t *symbol = find_symbol(rtmp->name);
-        if (!symbol)
+        symbol_t *symbol = rtmp->symbol;
+        if (!symbol->defined)
         {
-            err_print("Unknown symbol:'%s'", rtmp->name);
+            err_print("Unknown symbol:'%s'", symbol->name);
             return -1;
         }
         /* relocate y64bin according to itype */
@@ -917,15 +1153,55 @@ int relocate(void)
  */
 int binfile(FILE *out)
 {
+    line_t *nowline;
+    int64_t size = 0;
+    byte_t *image, *p;
+    ssize_t n;
+
+    /* the image ends with the last byte of code, gaps from .pos and .align stay zero */
+    for (nowline = line_head->next; nowline; nowline = nowline->next)
+    {
+        if (nowline->y64bin.bytes == 0)
+            continue;
+        if (nowline->y64bin.addr < 0)
+        {
+            err_print("Negative address %ld", (long)nowline->y64bin.addr);
+            return -1;
+        }
+        if (nowline->y64bin.addr + nowline->y64bin.bytes > size)
+            size = nowline->y64bin.addr + nowline->y64bin.bytes;
+    }
+
     /* prepare image with y64 binary code */
-    line_t *nowline = line_head->next;
-    /* binary write y64 code to output file (NOTE: see fwrite()) */
-    while (nowline)
+    image = (byte_t *)calloc(size ? size : 1, 1);
+    if (!image)
+    {
+        err_print("Out of memory for a %ld-byte image", (long)size);
+        return -1;
+    }
+    for (nowline = line_head->next; nowline; nowline = nowline->next)
+    {
+        /* empty lines may sit outside the image, so don't even form the address */
+        if (nowline->y64bin.bytes == 0)
+            continue;
+        memcpy(image + nowline->y64bin.addr, nowline->y64bin.codes, nowline->y64bin.bytes);
+    }
+
+    /* write it out at once (NOTE: see write()) */
+    fflush(out);
+    for (p = image; p < image + size; p += n)
     {
-        fseek(out, nowline->y64bin.addr, SEEK_SET);
-        fwrite(nowline->y64bin.codes, 1, nowline->y64bin.bytes, out);
-        nowline = nowline->next;
+        n = write(fileno(out), p, image + size - p);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n < 0)
+        {
+            err_print("Can't write the binary: %s", strerror(errno));
+            free(image);
+            return -1;
+        }
     }
+    free(image);
     return 0;
 }
 
@@ -966,7 +1242,7 @@ void print_line(line_t *line)
         strcpy(buf, "                              | ");
     }
 
-    printf("%s%s\n", buf, line->y64asm);
+    printf("%s%.*s\n", buf, line->len, line->y64asm);
 }
 
 /*
@@ -986,55 +1262,61 @@ void print_screen(void)
 /* init and finit */
 void init(void)
 {
-    reltab = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
-    memset(reltab, 0, sizeof(reloc_t));
+    int i, slot;
 
-    symtab = (symbol_t *)malloc(sizeof(symbol_t)); // free in finit
-    memset(symtab, 0, sizeof(symbol_t));
+    /* fill the lookup tables, the hashes must stay collision-free */
+    lineno = -1;
+    for (i = 0; i < REG_NONE; i++)
+    {
+        slot = hash_token(reg_table[i].name, reg_table[i].namelen, REG_HASH_MULT, REG_HASH_BITS);
+        if (reg_hash[slot])
+        {
+            err_print("Register hash collision: %s and %s", reg_hash[slot]->name,
+                      reg_table[i].name);
+            exit(1);
+        }
+        reg_hash[slot] = &reg_table[i];
+    }
+    for (i = 0; instr_set[i].name; i++)
+    {
+        slot = hash_token(instr_set[i].name, instr_set[i].len, INSTR_HASH_MULT, INSTR_HASH_BITS);
+        if (instr_hash[slot])
+        {
+            err_print("Instruction hash collision: %s and %s", instr_hash[slot]->name,
+                      instr_set[i].name);
+            exit(1);
+        }
+        instr_hash[slot] = &instr_set[i];
+    }
 
-    line_head = (line_t *)malloc(sizeof(line_t)); // free in finit
-    memset(line_head, 0, sizeof(line_t));
+    reltab = (reloc_t *)arena_alloc(sizeof(reloc_t));
+    reltail = reltab;
+
+    symcap = SYMTAB_INIT;
+    symcnt = 0;
+    symtab = (symbol_t **)calloc(symcap, sizeof(symbol_t *)); // free in finit
+
+    line_head = (line_t *)arena_alloc(sizeof(line_t));
     line_tail = line_head;
     lineno = 0;
 }
 
 void finit(void)
 {
-    reloc_t *rtmp = NULL;
-    do
-    {
-        rtmp = reltab->next;
-        if (reltab->name)
-            free(reltab->name);
-        free(reltab);
-        reltab = rtmp;
-    } while (reltab);
-
-    symbol_t *stmp = NULL;
-    do
-    {
-        stmp = symtab->next;
-        if (symtab->name)
-            free(symtab->name);
-        free(symtab);
-        symtab = stmp;
-    } while (symtab);
-
-    line_t *ltmp = NULL;
-    do
-    {
-        ltmp = line_head->next;
-        if (line_head->y64asm)
-            free(line_head->y64asm);
-        free(line_head);
-        line_head = ltmp;
-    } while (line_head);
+    free(symtab);
+    if (asm_mapped)
+        munmap(asm_text, asm_len);
+    else
+        free(asm_text);
+    arena_free();
 }
 
 static void usage(char *pname)
 {
-    printf("Usage: %s [-v] file.ys\n", pname);
+    printf("Usage: %s [-v] [-o file.bin] file.ys\n", pname);
     printf("   -v print the readable output to screen\n");
+    printf("   -o write the binary here instead of file.bin, '-' is stdout\n");
+    printf("   file.ys may be '-' to read stdin, which needs -o\n");
     exit(0);
 }
 
@@ -1043,51 +1325,69 @@ int main(int argc, char *argv[])
     int rootlen;
     char infname[512];
     char outfname[512];
-    int nextarg = 1;
+    char *inarg, *outname = NULL;
     FILE *in = NULL, *out = NULL;
+    int c;
 
-    if (argc < 2)
-        usage(argv[0]);
-
-    if (argv[nextarg][0] == '-')
+    while ((c = getopt(argc, argv, "vo:")) != -1)
     {
-        char flag = argv[nextarg][1];
-        switch (flag)
+        switch (c)
         {
         case 'v':
             screen = TRUE;
-            nextarg++;
+            break;
+        case 'o':
+            outname = optarg;
             break;
         default:
             usage(argv[0]);
         }
     }
-
-    /* parse input file name */
-    rootlen = strlen(argv[nextarg]) - 3;
-    /* only support the .ys file */
-    if (strcmp(argv[nextarg] + rootlen, ".ys"))
+    if (optind != argc - 1 || (screen && outname && !strcmp(outname, "-")))
         usage(argv[0]);
+    inarg = argv[optind];
 
-    if (rootlen > 500)
+    if (!strcmp(inarg, "-"))
     {
-        err_print("File name too long");
-        exit(1);
+        if (!outname)
+            usage(argv[0]);
+        in = stdin;
+    }
+    else
+    {
+        /* parse input file name */
+        rootlen = strlen(inarg) - 3;
+        /* only support the .ys file */
+        if (rootlen < 0 || strcmp(inarg + rootlen, ".ys"))
+            usage(argv[0]);
+
+        if (rootlen > 500)
+        {
+            err_print("File name too long");
+            exit(1);
+        }
+
+        memcpy(infname, inarg, rootlen);
+        strcpy(infname + rootlen, ".ys");
+        in = fopen(infname, "r");
+        if (!in)
+        {
+            err_print("Can't open input file '%s'", infname);
+            exit(1);
+        }
+
+        if (!outname)
+        {
+            memcpy(outfname, inarg, rootlen);
+            strcpy(outfname + rootlen, ".bin");
+            outname = outfname;
+        }
     }
 
     /* init */
     init();
 
     /* assemble .ys file */
-    strncpy(infname, argv[nextarg], rootlen);
-    strcpy(infname + rootlen, ".ys");
-    in = fopen(infname, "r");
-    if (!in)
-    {
-        err_print("Can't open input file '%s'", infname);
-        exit(1);
-    }
-
     if (assemble(in) < 0)
     {
         err_print("Assemble y64 code error");
@@ -1104,12 +1404,10 @@ int main(int argc, char *argv[])
     }
 
     /* generate .bin file */
-    strncpy(outfname, argv[nextarg], rootlen);
-    strcpy(outfname + rootlen, ".bin");
-    out = fopen(outfname, "wb");
+    out = strcmp(outname, "-") ? fopen(outname, "wb") : stdout;
     if (!out)
     {
-        err_print("Can't open output file '%s'", outfname);
+        err_print("Can't open output file '%s'", outname);
         exit(1);
     }
 
@@ -6,8 +6,6 @@
 #include <string.h>
 #include <assert.h>
 
-#define MAX_INSLEN 512
-
 typedef unsigned char byte_t;
 typedef int64_t word_t;
 typedef enum
@@ -131,25 +129,36 @@ typedef struct line
 {
     type_t type; /* TYPE_COMM: no y64bin, TYPE_INS: both y64bin and y64asm */
     bin_t y64bin;
-    char *y64asm;
+    char *y64asm; /* slice of the input, 'len' bytes long */
+    int len;
     struct line *next;
 } line_t;
 
-/* label defined in y64 assembly code, e.g. Loop */
+/* label used or defined in y64 assembly code, e.g. Loop (one per name) */
 typedef struct symbol
 {
     char *name;
     int len;
+    unsigned hash;
+    bool_t defined; /* FALSE while only used by relocations */
     int64_t addr;
-    struct symbol *next;
 } symbol_t;
 
 /* binary code need to be relocated */
 typedef struct reloc
 {
     bin_t *y64bin;
-    char *name;
+    symbol_t *symbol;
     struct reloc *next;
 } reloc_t;
 
+/* block of the arena that holds lines, symbols and relocations */
+typedef struct arena_blk
+{
+    struct arena_blk *next;
+    size_t used;
+    size_t size;
+    byte_t data[];
+} arena_blk_t;
+
 #endif